@@ -7,6 +7,7 @@
 #include <cstddef>
 #include <new>
 #include <cstdio>
+#include <cstdlib>
 
 // responsible for taking up space in memory
 // it will allocate 4096 bytes, or a page in windows memory.
@@ -24,40 +25,83 @@ struct Heap
     {
         // first check whether the number of bytes is greater than the bucket size
         if (bytes > Bucket::data_size) throw std::bad_alloc{};
-        // iterate through the buckets looking for one that isn't marked true in buckets used
-        // if it finds an unused Bucket, then it returns data member pointer for the associated bucket.
-        for (size_t i{}; i < n_heap_buckets; i++)
+        // pop the most recently freed bucket off the free list. If there isn't one, hand out the next bucket that
+        // has never been used. Both are constant time, no matter how many buckets are in use.
+        Bucket* bucket{};
+        if (free_list)
         {
-            if (!bucket_used[i])
-            {
-                bucket_used[i] = true;
-                return buckets[i].data;
-            }
+            bucket = free_list->bucket;
+            free_list = free_list->next;
         }
-        // throw an bad_alloc exception if it can't find an unused bucket.
-        throw std::bad_alloc{};
+        else if (n_fresh < n_heap_buckets)
+        {
+            bucket = &buckets[n_fresh++];
+        }
+        else
+        {
+            // throw an bad_alloc exception if it can't find an unused bucket.
+            throw std::bad_alloc{};
+        }
+        bucket_used[bucket - buckets] = true;
+        return bucket->data;
     }
-    // accepts a void* and iterates through all the buckets looking for a matching data member pointer.
-    // If it finds one, it sets bucket_used for the corresponding bucket to false and returns.
+    // accepts a void* and works out which bucket it points into from its offset into buckets.
+    // If it belongs to a loaned out bucket, it sets bucket_used for the corresponding bucket to false and pushes the
+    // bucket onto the free list. Pointers outside buckets never came from the heap, so they go to fallback_free
+    // instead of being dropped. Pointers into buckets that aren't the start of a loaned out bucket are ignored.
     void free(void* p)
     {
-        for (size_t i{}; i < n_heap_buckets; i++)
+        const auto address = static_cast<std::byte*>(p);
+        const auto first = buckets[0].data;
+        if (address < first || address >= first + sizeof(buckets))
         {
-            if (buckets[i].data == p)
-            {
-                bucket_used[i] = false;
-                return;
-            }
+            if (p) fallback_free(p);
+            return;
         }
+        const size_t i = (address - first) / sizeof(Bucket);
+        if (address != buckets[i].data || !bucket_used[i]) return;
+        bucket_used[i] = false;
+        // the free list is intrusive: the link is constructed inside the free bucket's own data with placement new.
+        free_list = new(buckets[i].data) FreeBucket{&buckets[i], free_list};
     }
 
+    // lives inside the data of a bucket that isn't loaned out, and points at the next free bucket.
+    struct FreeBucket
+    {
+        Bucket* bucket;
+        FreeBucket* next;
+    };
+
     static const size_t n_heap_buckets{10};
     // buckets member houses all the Buckets, packed into a contiguous string
     Bucket buckets[n_heap_buckets]{};
     // keeps track of whether a Bucket in buckets with the same index has been loaned out yet.
-    bool bucket_used[n_heap_buckets];
+    bool bucket_used[n_heap_buckets]{};
+    // the most recently freed bucket. Freed buckets are handed out again last-in, first-out.
+    FreeBucket* free_list{};
+    // number of buckets handed out at least once. Buckets from n_fresh onwards are handed out in index order.
+    size_t n_fresh{};
+    // releases memory that didn't come from this heap, like a block a C library allocated with malloc.
+    // defaults to std::free.
+    void (*fallback_free)(void*){std::free};
 };
 
+// buckets are handed out in a deterministic order: never-used buckets in index order, freed buckets last-in, first-out.
+// checked on a scratch heap so the global heap used by operator new isn't disturbed.
+bool check_bucket_order()
+{
+    static Heap scratch;
+    void* first = scratch.allocate(1);
+    void* second = scratch.allocate(1);
+    void* third = scratch.allocate(1);
+    if (first != scratch.buckets[0].data || second != scratch.buckets[1].data || third != scratch.buckets[2].data)
+    {
+        return false;
+    }
+    scratch.free(first);
+    scratch.free(third);
+    return scratch.allocate(1) == third && scratch.allocate(1) == first && scratch.allocate(1) == scratch.buckets[3].data;
+}
 
 Heap heap;
 
@@ -84,9 +128,17 @@ int main()
     // print the memory address of dinner. This is exactly 0x1000 greater than at breakfast, which is about the size
     // of a page.
     printf("Dinner:    %p 0x%x\n", dinner, *dinner);
+    printf("Bucket order is %s.\n", check_bucket_order() ? "deterministic" : "NOT deterministic");
     // delete breakfast and dinner to free up memory
     delete breakfast;
     delete dinner;
+    // a pointer the heap never handed out goes to the fallback deallocator instead of being dropped.
+    heap.fallback_free = [](void* p)
+    {
+        printf("Foreign:   %p handed to the fallback deallocator.\n", p);
+        std::free(p);
+    };
+    heap.free(std::malloc(sizeof(unsigned int)));
     // now allocate char's on the heap until the heap runs out of memory. Each char takes up about
     // 4096 bytes of memory!
     try {
@@ -0,0 +1,141 @@
+// allocation_trace.hpp holds the format of an allocation trace, and the TraceRecorder that writes one from inside the
+// operator new and operator delete overrides in overloadedNewOperator.cpp. trace_replay.cpp reads traces back and
+// replays them against different allocators.
+
+#ifndef CRASH_COURSE_ALLOCATION_TRACE_HPP
+#define CRASH_COURSE_ALLOCATION_TRACE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+
+// A trace file starts with trace_magic, followed by nothing but TraceEvents. Each TraceEvent is one allocation or one
+// free. The pointer is the allocation's address, which identifies it until it is freed: the same address can come up
+// again for a later allocation, but never for two live ones. A free records the size only if it was a sized delete,
+// and zero otherwise. Sizes of 4 GiB or more are recorded as UINT32_MAX.
+// The events of each thread are in order, but the events of different threads are interleaved only as their buffers
+// were written out, so a reader sorts them by time.
+inline constexpr char trace_magic[8]{ 'H', 'E', 'A', 'P', 'T', 'R', 'C', '1' };
+
+struct TraceEvent
+{
+    enum Kind : uint8_t
+    {
+        allocation,
+        free
+    };
+
+    uint64_t time_ns;
+    uint64_t pointer;
+    uint32_t size;
+    uint16_t thread;
+    Kind kind;
+    // alignment_log2 is the alignment asked for, as a power of two, or zero for the usual alignment.
+    uint8_t alignment_log2;
+};
+static_assert(sizeof(TraceEvent) == 24, "A TraceEvent packs into 24 bytes.");
+
+// TraceRecorder writes a trace to the file named by the HEAP_TRACE environment variable, and does nothing at all if
+// it isn't set. The overrides call it on every allocation and free, so it must never allocate itself. Each thread
+// collects its events in a buffer of its own, without taking a lock, and only writes the whole buffer to the file,
+// under write_lock, when it fills up or the thread exits.
+// A TraceRecorder can be constant initialized, so it's usable from the very first operator new, before any dynamic
+// initialization has run. The environment variable is read the first time an event comes in.
+struct TraceRecorder
+{
+    void record(TraceEvent::Kind kind, const void* p, size_t bytes, size_t alignment)
+    {
+        const auto current = state.load(std::memory_order_acquire);
+        if (current == State::off || (current == State::unknown && !start())) return;
+        auto& buffer = thread_buffer();
+        if (buffer.thread == 0) register_thread(buffer);
+        const auto time = std::chrono::steady_clock::now().time_since_epoch();
+        buffer.events[buffer.count++] = TraceEvent{
+            static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count()),
+            reinterpret_cast<uintptr_t>(p), bytes < UINT32_MAX ? static_cast<uint32_t>(bytes) : UINT32_MAX,
+            buffer.thread, kind, static_cast<uint8_t>(alignment ? __builtin_ctzll(alignment) : 0) };
+        // A thread that has already exited writes every event out right away.
+        if (buffer.count == Buffer::capacity || buffer.retired) write_out(buffer);
+    }
+
+private:
+    enum class State
+    {
+        unknown,
+        off,
+        on
+    };
+
+    struct Buffer
+    {
+        static const size_t capacity{ 1024 };
+        TraceEvent events[capacity];
+        size_t count;
+        uint16_t thread;
+        bool retired;
+    };
+
+    // start opens the trace file, the first time an event comes in, and reports whether tracing is on.
+    bool start()
+    {
+        std::lock_guard<std::mutex> lock{ write_lock };
+        if (state.load(std::memory_order_relaxed) == State::unknown)
+        {
+            const auto path = std::getenv("HEAP_TRACE");
+            fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+            const auto started = fd >= 0 && write(fd, trace_magic, sizeof(trace_magic)) == sizeof(trace_magic);
+            state.store(started ? State::on : State::off, std::memory_order_release);
+        }
+        return state.load(std::memory_order_relaxed) == State::on;
+    }
+
+    static Buffer& thread_buffer()
+    {
+        static thread_local Buffer buffer{};
+        return buffer;
+    }
+
+    // register_thread numbers the thread and creates a thread-local Retirer, whose destructor writes out what is left
+    // in the buffer when the thread exits, like ThreadCache does.
+    void register_thread(Buffer& buffer)
+    {
+        buffer.thread = static_cast<uint16_t>(n_threads.fetch_add(1, std::memory_order_relaxed) + 1);
+        struct Retirer
+        {
+            TraceRecorder* recorder;
+            Buffer* buffer;
+            ~Retirer()
+            {
+                recorder->write_out(*buffer);
+                buffer->retired = true;
+            }
+        };
+        static thread_local Retirer retirer{ this, &buffer };
+    }
+
+    void write_out(Buffer& buffer)
+    {
+        std::lock_guard<std::mutex> lock{ write_lock };
+        const auto bytes = buffer.count * sizeof(TraceEvent);
+        for (size_t written{}; written < bytes;)
+        {
+            const auto n = write(fd, reinterpret_cast<const char*>(buffer.events) + written, bytes - written);
+            if (n <= 0) break;
+            written += n;
+        }
+        buffer.count = 0;
+    }
+
+    std::atomic<State> state{ State::unknown };
+    std::atomic<uint32_t> n_threads{};
+    std::mutex write_lock;
+    int fd{ -1 };
+};
+
+#endif //CRASH_COURSE_ALLOCATION_TRACE_HPP
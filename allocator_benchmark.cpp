@@ -0,0 +1,334 @@
+// Allocator benchmark
+// Runs the same workloads against the Heap from heap.hpp and against the system allocator (malloc and free), so you can
+// tell when the Heap helps and when it hurts. Heap is used through a ThreadCache, the way the operator new override in
+// overloadedNewOperator.cpp uses it, but this program doesn't replace operator new itself.
+
+// The workloads are:
+//  * fixed-size churn: every thread allocates a burst of 64-byte objects and frees them again, over and over.
+//  * random sizes: every thread keeps a table of live objects of random sizes, from a few bytes up to 16 KiB, and
+//    randomly frees or refills its entries.
+//  * producer/consumer: threads are paired up. The producer allocates messages and passes them to its consumer, which
+//    frees them, so every free happens on a different thread than its allocation. The Heap sends each freed message
+//    back to its producer through a remote-free queue. This workload also runs on a second Heap with remote frees
+//    switched off, reported as "Heap, local", where the consumer keeps the freed messages in its own ThreadCache.
+//  * linked list: every thread builds a long singly linked list, walks it and tears it down again.
+//  * pmr containers: every thread keeps a std::pmr::unordered_map of std::pmr::vectors and randomly inserts and erases
+//    its entries. Neither allocator is used directly: the containers get their memory from a std::pmr::memory_resource,
+//    which is a HeapResource for the Heap and std::pmr::new_delete_resource() for the system allocator. Here, an
+//    operation is one insert or erase, which allocates or frees several times over.
+
+// For every workload, allocator and number of threads, the benchmark reports the throughput in millions of allocations
+// and frees per second, the 99th percentile latency of a single allocation or free, and how much the resident set grew
+// at its peak. Each run happens in a child process of its own, so the runs can't disturb one another's memory.
+
+// Build and run with:
+//  g++ -std=c++17 -O2 -pthread allocator_benchmark.cpp -o allocator_benchmark
+//  ./allocator_benchmark [max threads]
+
+#include "heap.hpp"
+#include "measurement.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+Heap heap;
+thread_local ThreadCache thread_cache{ heap };
+HeapResource heap_resource{ heap };
+
+struct HeapAllocator
+{
+    static constexpr const char* name{ "Heap" };
+    static void* allocate(size_t bytes)
+    {
+        return thread_cache.allocate(bytes);
+    }
+    static void free(void* p)
+    {
+        thread_cache.free(p);
+    }
+    static std::pmr::memory_resource* resource()
+    {
+        return &heap_resource;
+    }
+};
+
+// local_heap has remote frees switched off, to show what they buy in the producer/consumer workload.
+Heap local_heap;
+thread_local ThreadCache local_cache{ local_heap };
+
+struct LocalHeapAllocator
+{
+    static constexpr const char* name{ "Heap, local" };
+    static void* allocate(size_t bytes)
+    {
+        return local_cache.allocate(bytes);
+    }
+    static void free(void* p)
+    {
+        local_cache.free(p);
+    }
+};
+
+struct SystemAllocator
+{
+    static constexpr const char* name{ "malloc" };
+    static void* allocate(size_t bytes)
+    {
+        return std::malloc(bytes);
+    }
+    static void free(void* p)
+    {
+        std::free(p);
+    }
+    // operator new isn't replaced in this program, so new_delete_resource ends up in malloc too.
+    static std::pmr::memory_resource* resource()
+    {
+        return std::pmr::new_delete_resource();
+    }
+};
+
+// A Recorder counts a thread's operations and times every sample_every-th one. Timing every operation would measure
+// the clock more than the allocator.
+struct Recorder
+{
+    template <typename Operation>
+    auto operator()(Operation operation)
+    {
+        if (++n_operations % sample_every != 0) return operation();
+        const auto start = std::chrono::steady_clock::now();
+        const auto result = operation();
+        const auto stop = std::chrono::steady_clock::now();
+        latencies_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+        return result;
+    }
+
+    static const size_t sample_every{ 32 };
+    size_t n_operations{};
+    std::vector<uint32_t> latencies_ns;
+};
+
+// next_random is a xorshift generator, cheap enough not to show up next to an allocation.
+uint64_t next_random(uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Each workload runs on one thread. thread is the thread's number among n_threads.
+template <typename Allocator>
+void fixed_size_churn(Recorder& record, size_t, size_t)
+{
+    const size_t n_rounds{ 20'000 }, burst{ 64 };
+    void* objects[burst];
+    for (size_t round{}; round < n_rounds; round++)
+    {
+        for (auto& object : objects)
+        {
+            object = record([] { return Allocator::allocate(64); });
+            *static_cast<char*>(object) = 1;
+        }
+        for (auto object : objects) record([object] { Allocator::free(object); return 0; });
+    }
+}
+
+template <typename Allocator>
+void random_sizes(Recorder& record, size_t thread, size_t)
+{
+    const size_t n_operations{ 2'000'000 }, n_entries{ 1024 };
+    std::vector<void*> entries(n_entries);
+    uint64_t state{ 0x9E3779B97F4A7C15ULL * (thread + 1) };
+    for (size_t i{}; i < n_operations; i++)
+    {
+        auto& entry = entries[next_random(state) % n_entries];
+        if (entry)
+        {
+            const auto object = entry;
+            record([object] { Allocator::free(object); return 0; });
+            entry = nullptr;
+        }
+        else
+        {
+            // Small sizes are far more common than big ones: pick a power of two, then a size below it.
+            const auto limit = size_t{ 16 } << next_random(state) % 11;
+            const auto bytes = 1 + next_random(state) % limit;
+            entry = record([bytes] { return Allocator::allocate(bytes); });
+            *static_cast<char*>(entry) = 1;
+        }
+    }
+    for (auto entry : entries) Allocator::free(entry);
+}
+
+// Producers and consumers pass messages through a Ring, a bounded single-producer, single-consumer queue. Each pair of
+// threads shares one.
+struct Ring
+{
+    static const size_t capacity{ 1024 };
+    void* messages[capacity];
+    alignas(64) std::atomic<size_t> head{};
+    alignas(64) std::atomic<size_t> tail{};
+};
+
+template <typename Allocator>
+void producer_consumer(Recorder& record, size_t thread, size_t n_threads)
+{
+    static std::vector<Ring> rings(n_threads / 2);
+    const size_t n_messages{ 500'000 };
+    auto& ring = rings[thread / 2];
+    if (thread % 2 == 0)
+    {
+        for (size_t i{}; i < n_messages; i++)
+        {
+            const auto message = record([] { return Allocator::allocate(48); });
+            *static_cast<size_t*>(message) = i;
+            const auto tail = ring.tail.load(std::memory_order_relaxed);
+            while (tail - ring.head.load(std::memory_order_acquire) == Ring::capacity) std::this_thread::yield();
+            ring.messages[tail % Ring::capacity] = message;
+            ring.tail.store(tail + 1, std::memory_order_release);
+        }
+    }
+    else
+    {
+        for (size_t i{}; i < n_messages; i++)
+        {
+            const auto head = ring.head.load(std::memory_order_relaxed);
+            while (ring.tail.load(std::memory_order_acquire) == head) std::this_thread::yield();
+            const auto message = ring.messages[head % Ring::capacity];
+            ring.head.store(head + 1, std::memory_order_release);
+            record([message] { Allocator::free(message); return 0; });
+        }
+    }
+}
+
+template <typename Allocator>
+void linked_list(Recorder& record, size_t, size_t)
+{
+    struct Node
+    {
+        Node* next;
+        uint64_t value[3];
+    };
+    const size_t n_rounds{ 20 }, n_nodes{ 50'000 };
+    uint64_t sum{};
+    for (size_t round{}; round < n_rounds; round++)
+    {
+        Node* head{};
+        for (size_t i{}; i < n_nodes; i++)
+        {
+            const auto node = static_cast<Node*>(record([] { return Allocator::allocate(sizeof(Node)); }));
+            node->next = head;
+            node->value[0] = i;
+            head = node;
+        }
+        for (auto node = head; node; node = node->next) sum += node->value[0];
+        while (head)
+        {
+            const auto node = head;
+            head = head->next;
+            record([node] { Allocator::free(node); return 0; });
+        }
+    }
+    if (sum == 42) printf("The answer.\n");
+}
+
+template <typename Allocator>
+void pmr_containers(Recorder& record, size_t thread, size_t)
+{
+    const size_t n_operations{ 1'000'000 }, n_keys{ 4096 };
+    std::pmr::unordered_map<uint64_t, std::pmr::vector<uint32_t>> table{ Allocator::resource() };
+    uint64_t state{ 0x9E3779B97F4A7C15ULL * (thread + 1) };
+    for (size_t i{}; i < n_operations; i++)
+    {
+        const auto key = next_random(state) % n_keys;
+        const auto entry = table.find(key);
+        if (entry != table.end())
+        {
+            record([&] { table.erase(entry); return 0; });
+        }
+        else
+        {
+            // The vector is constructed with the map's memory_resource, so its elements come from the same place.
+            const auto length = 1 + next_random(state) % 64;
+            record([&] { table[key].resize(length); return 0; });
+        }
+    }
+}
+
+struct Result
+{
+    double mops;
+    double p99_ns;
+    double peak_rss_mib;
+};
+
+// measure runs workload on n_threads threads at once and sums up their Recorders.
+template <typename Workload>
+Result measure(Workload workload, size_t n_threads)
+{
+    const auto rss_before = resident_kib();
+    std::vector<Recorder> recorders(n_threads);
+    std::vector<std::thread> threads;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t t{}; t < n_threads; t++)
+    {
+        threads.emplace_back([&, t] { workload(recorders[t], t, n_threads); });
+    }
+    for (auto& thread : threads) thread.join();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    size_t n_operations{};
+    std::vector<uint32_t> latencies;
+    for (auto& recorder : recorders)
+    {
+        n_operations += recorder.n_operations;
+        latencies.insert(latencies.end(), recorder.latencies_ns.begin(), recorder.latencies_ns.end());
+    }
+    const auto p99 = latencies.begin() + latencies.size() * 99 / 100;
+    std::nth_element(latencies.begin(), p99, latencies.end());
+    return Result{ n_operations / elapsed.count() / 1e6, latencies.empty() ? 0.0 : static_cast<double>(*p99),
+                   peak_growth_mib(rss_before) };
+}
+
+template <typename Allocator>
+void report(const char* workload_name, void (*workload)(Recorder&, size_t, size_t), size_t n_threads)
+{
+    Result result{};
+    if (!run_in_child([&] { return measure(workload, n_threads); }, result))
+    {
+        printf("%-18s %7zu  %-11s  failed\n", workload_name, n_threads, Allocator::name);
+        return;
+    }
+    printf("%-18s %7zu  %-11s %8.1f %8.0f %12.1f\n", workload_name, n_threads, Allocator::name, result.mops,
+           result.p99_ns, result.peak_rss_mib);
+}
+
+int main(int argc, char* argv[])
+{
+    const size_t max_threads{ argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+                                       : std::max(std::thread::hardware_concurrency(), 2u) };
+    local_heap.set_remote_frees(false);
+    printf("%-18s %7s  %-11s %8s %8s %12s\n", "workload", "threads", "allocator", "Mops/s", "p99 ns", "peak RSS MiB");
+    for (size_t n_threads{ 1 }; n_threads <= max_threads; n_threads *= 2)
+    {
+        report<HeapAllocator>("fixed-size churn", fixed_size_churn<HeapAllocator>, n_threads);
+        report<SystemAllocator>("fixed-size churn", fixed_size_churn<SystemAllocator>, n_threads);
+        report<HeapAllocator>("random sizes", random_sizes<HeapAllocator>, n_threads);
+        report<SystemAllocator>("random sizes", random_sizes<SystemAllocator>, n_threads);
+        report<HeapAllocator>("linked list", linked_list<HeapAllocator>, n_threads);
+        report<SystemAllocator>("linked list", linked_list<SystemAllocator>, n_threads);
+        report<HeapAllocator>("pmr containers", pmr_containers<HeapAllocator>, n_threads);
+        report<SystemAllocator>("pmr containers", pmr_containers<SystemAllocator>, n_threads);
+        // The producer/consumer workload needs threads in pairs.
+        const auto n_paired = std::max<size_t>(2, n_threads / 2 * 2);
+        report<HeapAllocator>("producer/consumer", producer_consumer<HeapAllocator>, n_paired);
+        report<LocalHeapAllocator>("producer/consumer", producer_consumer<LocalHeapAllocator>, n_paired);
+        report<SystemAllocator>("producer/consumer", producer_consumer<SystemAllocator>, n_paired);
+    }
+}
@@ -3,9 +3,20 @@
 //
 
 #include <stdexcept>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <chrono>
+#include <initializer_list>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 // throws an exception whenever you invoke the forget method with an argument equal to 0xFACE.
 struct Groucho
@@ -24,44 +35,68 @@ struct Groucho
 // using a copy constructor could potentially double free if copied.
 struct SimpleString
 {
-    /* constructor takes a single max_size argument. This is the maximum length
-     * of the string, which includes a null terminator.
+    /* A fixed SimpleString never allocates after its constructor: once max_size is reached, append_line
+     * returns false. A growable one reallocates its buffer instead, to twice its size or to whatever the
+     * new line needs, if that's more. Doubling means that however many lines are appended, every
+     * character is copied over only a couple of times on average, so an append takes amortized constant time.
+     */
+    enum class Mode
+    {
+        fixed,
+        growable
+    };
+
+    /* constructor takes a max_size argument. This is the maximum length
+     * of the string, which includes a null terminator. For a growable string, it's only where it starts.
      * member initializer saves this length into max_size member variable.
      * length is initialized to 0 and ensures enough size for a null byte
      * This pattern is called resource acquisition is initialization (RAII) or
      * constructor acquires, destructor releases (CADRe)
     */
-     SimpleString(size_t max_size) : max_size{max_size}, length{}
+     SimpleString(size_t max_size, Mode mode = Mode::fixed)
+     : length{}, growable{mode == Mode::growable}, on_heap{max_size > inline_size}
     {
         if (max_size == 0)
         {
             throw std::runtime_error{"Max size must be at least 1."};
         }
         // a buffer to store the string
-        // max_size is used to allocate buffer to store string.
-        buffer = new char[max_size];
+        // max_size is used to allocate buffer to store string. A string that fits in inline_size
+        // characters doesn't need the heap at all: it keeps them in the object's own inline array.
+        if (on_heap)
+        {
+            heap = {new char[max_size], max_size};
+        }
+        else
+        {
+            local.max_size = static_cast<unsigned char>(max_size);
+        }
         // string is initially empty so the first byte of the buffer is initialized to zero.
-        buffer[0] = 0;
+        data()[0] = 0;
     }
     /* include a move constructor instead of copy constructor to safely copy simple string object
      * Pass in the corresponding fields max_size, buffer, and length, into other.
      * Designed to not throw an exception. This is less expensive than executing copy constructor
+     * A string on the heap hands over its pointer. An inline string can't: its characters live inside
+     * other, so they're copied over instead, which is at most inline_size bytes.
+     * other is left empty, with its inline array as its buffer and a max_size of 0, so it can still be
+     * printed and destroyed, but appending to it fails.
      */
     SimpleString(SimpleString&& other) noexcept
-    : max_size{other.max_size}, buffer(other.buffer), length(other.length)
+    : length(other.length), growable{other.growable}, on_heap{other.on_heap},
+      index{std::move(other.index)}
     {
-        other.length = 0;
-        other.buffer = nullptr;
-        other.max_size;
+        take(other);
     }
 
     /* The SimpleString class owns a resource -- the memory pointed to by buffer -- which
      * must be released when it's not longer needed.
-     * This destructor deallocates buffer, preventing a memory leak
+     * This destructor deallocates buffer, preventing a memory leak. An inline buffer is
+     * part of the object, so there's nothing to deallocate.
     */
      ~SimpleString()
     {
-        delete[] buffer;
+        if (on_heap) delete[] heap.buffer;
     }
 
 
@@ -76,14 +111,13 @@ struct SimpleString
         }
 
         // delete the old buffer
-        delete[] buffer;
-        // reassign buffer
-        buffer = other.buffer;
+        if (on_heap) delete[] heap.buffer;
+        // reassign buffer, or copy the characters of an inline one, like the move constructor does
         length = other.length;
-        max_size = other.max_size;
-        other.buffer = nullptr;
-        other.length = 0;
-        other.max_size = 0;
+        growable = other.growable;
+        on_heap = other.on_heap;
+        index = std::move(other.index);
+        take(other);
         return *this;
     }
 
@@ -94,7 +128,7 @@ struct SimpleString
      */
     void print(const char* tag) const
     {
-        printf("%s: %s", tag, buffer);
+        printf("%s: %s", tag, data());
     }
     /*
      * append_line method takes a null-terminated string x and adds its contents --
@@ -105,18 +139,41 @@ struct SimpleString
      * This result is used to determine whether appending x (a newline character) and a null byte
      * to the current string would result in a string with length greater than max_size.
      * If this happens, then append_line returns false.
+     * The rest of the work is done by the overload below, which takes the length along with x.
      */
     bool append_line(const char* x)
     {
-        const auto x_len = strlen(x);
-        if (x_len + length + 2 > max_size)
+        return append_line(x, strlen(x));
+    }
+
+    // a std::string_view already knows its length, so appending one needs no strlen at all.
+    bool append_line(std::string_view x)
+    {
+        return append_line(x.data(), x.size());
+    }
+
+    /*
+     * append_line with a pointer and a length appends the x_len characters starting at x, which don't
+     * need to be null-terminated. This overload is the one that does the copying.
+     * x may point into the string itself, as in s.append_line(s.line(0)). Growing copies the characters to
+     * the new buffer before it frees or overwrites the old ones, so x is then read from there instead.
+     */
+    bool append_line(const char* x, size_t x_len)
+    {
+        if (x_len + length + 2 > max_size())
         {
-            return false;
+            const auto old_data = reinterpret_cast<uintptr_t>(data());
+            if (!grow(x_len + length + 2))
+            {
+                return false;
+            }
+            x = moved(x, old_data);
         }
-        // Need to copy its bytes into the correct location in buffer. The strncpy function
-        // accepts three arguments: the destination address, the source address, and the num of chars to copy.
-        // this returns destination, which is then discarded
-        std::strncpy(buffer + length, x, max_size - length);
+        // Need to copy its bytes into the correct location in buffer. memcpy copies exactly x_len bytes
+        // and nothing more. strncpy, which this used to call, would also zero-fill the whole rest of the
+        // buffer on every call, so building a big string one line at a time took quadratic time.
+        const auto buffer = data();
+        std::memcpy(buffer + length, x, x_len);
         length += x_len;
         // add newline character and null byte to end of buffer
         buffer[length++] = '\n';
@@ -124,10 +181,260 @@ struct SimpleString
         // return true if you've successfully appended the input x as a line to the end of buffer
         return true;
     }
+    /*
+     * append_lines appends every string in lines, each followed by a newline, all at once. Anything a
+     * std::string_view can be made from will do as a line: a null-terminated string, a std::string, or a
+     * std::string_view itself. It adds up the length of all the lines first, checks once whether they fit,
+     * or grows the buffer once, and then copies them one after the other.
+     * It's all or nothing: if the lines don't all fit in a fixed string, it returns false and appends none of
+     * them, so the string is never left with only some of them. A null-terminated line has its length
+     * counted once for the check and once for the copy, so pass string_views if that matters.
+     * Like append_line, it reads any line that views the string's own characters from the new buffer if it grows.
+     */
+    template <typename Lines>
+    bool append_lines(const Lines& lines)
+    {
+        size_t total{};
+        for (const auto& line : lines)
+        {
+            total += std::string_view{line}.size() + 1;
+        }
+        const auto old_data = reinterpret_cast<uintptr_t>(data());
+        const auto grown = total + length + 1 > max_size();
+        if (grown && !grow(total + length + 1))
+        {
+            return false;
+        }
+        const auto buffer = data();
+        auto end = buffer + length;
+        for (const auto& line : lines)
+        {
+            const std::string_view view{line};
+            std::memcpy(end, grown ? moved(view.data(), old_data) : view.data(), view.size());
+            end += view.size();
+            *end++ = '\n';
+        }
+        *end = 0;
+        length = end - buffer;
+        return true;
+    }
+
+    // this overload lets the lines be listed right in the call, as in append_lines({"one", "two"}).
+    bool append_lines(std::initializer_list<std::string_view> lines)
+    {
+        return append_lines<std::initializer_list<std::string_view>>(lines);
+    }
+
+    /*
+     * line_count and line treat the string as a text of lines, and find line n without rescanning the text
+     * every time. The first call builds an index of where every newline is, and keeps it. A SimpleString
+     * only ever grows at the end, so the index never goes stale: after an append, the next call only scans
+     * the characters appended since. Looking up a line is then just two reads from the index.
+     * The index is only allocated on the first call, so a string that is never asked for its lines pays
+     * just one pointer for it. But it does allocate, even for a fixed string; a caller that must never
+     * allocate shouldn't ask for lines. Building it from const methods makes it unsafe to call them from
+     * several threads at once.
+     */
+    size_t line_count() const
+    {
+        return update_index().newlines.size();
+    }
+
+    // line returns line n, counting from zero, without its newline. It throws std::out_of_range if there is
+    // no such line.
+    std::string_view line(size_t n) const
+    {
+        const auto& newlines = update_index().newlines;
+        if (n >= newlines.size())
+        {
+            throw std::out_of_range{"No such line."};
+        }
+        const auto start = n == 0 ? 0 : newlines[n - 1] + 1;
+        return std::string_view{data() + start, newlines[n] - start};
+    }
+
+    /*
+     * reserve makes room for a string of new_size characters, including the null byte, so appending up to
+     * that size doesn't reallocate again. shrink_to_fit does the opposite, and gives back whatever room the
+     * string doesn't use, moving it back inline if it fits there. Both only work on growable strings and
+     * return false on fixed ones, whose buffer never changes. Like any allocation, they can throw
+     * std::bad_alloc, in which case the string stays as it was.
+     */
+    bool reserve(size_t new_size)
+    {
+        if (!growable) return false;
+        if (new_size > max_size()) reallocate(new_size);
+        return true;
+    }
+
+    bool shrink_to_fit()
+    {
+        if (!growable) return false;
+        if (on_heap && length + 1 < heap.max_size) reallocate(length + 1);
+        return true;
+    }
+
 private:
-    size_t max_size;
-    char* buffer;
-    size_t length;
+    // grow makes room for at least needed characters in a growable string, or returns false for a fixed one.
+    bool grow(size_t needed)
+    {
+        if (!growable) return false;
+        reallocate(needed > 2 * max_size() ? needed : 2 * max_size());
+        return true;
+    }
+
+    // moved returns where x points now that the characters have moved away from old_data, if it pointed into
+    // them. The addresses are compared as integers, since the old buffer may already be freed.
+    const char* moved(const char* x, uintptr_t old_data) const
+    {
+        const auto offset = reinterpret_cast<uintptr_t>(x) - old_data;
+        return offset < length ? data() + offset : x;
+    }
+
+    // reallocate moves the string into a buffer of new_size characters, the inline one if it fits. The new
+    // buffer is allocated before anything changes, so if that throws, the string is left as it was.
+    void reallocate(size_t new_size)
+    {
+        if (new_size > inline_size)
+        {
+            const auto new_buffer = new char[new_size];
+            std::memcpy(new_buffer, data(), length + 1);
+            if (on_heap) delete[] heap.buffer;
+            heap = {new_buffer, new_size};
+            on_heap = true;
+        }
+        else if (on_heap)
+        {
+            // the inline characters overwrite the heap pointer, so it has to be read out first
+            const auto old_buffer = heap.buffer;
+            std::memcpy(local.buffer, old_buffer, length + 1);
+            delete[] old_buffer;
+            on_heap = false;
+            local.max_size = inline_size;
+        }
+        else
+        {
+            local.max_size = inline_size;
+        }
+    }
+
+    // LineIndex holds the position of every newline in the first indexed characters.
+    struct LineIndex
+    {
+        std::vector<size_t> newlines;
+        size_t indexed{};
+    };
+
+    /*
+     * update_index scans the characters appended since the last call for newlines. With AVX2 it compares 32
+     * characters against '\n' at once, with SSE2 16, and then walks the bits of the resulting mask, one for
+     * each newline. Whatever is left at the end, less than a full register, is checked one at a time.
+     * It creates the index on the first call, and returns it.
+     */
+    LineIndex& update_index() const
+    {
+        if (!index) index = std::make_unique<LineIndex>();
+        auto& newlines = index->newlines;
+        const auto buffer = data();
+        auto i = index->indexed;
+#if defined(__AVX2__)
+        const auto newline = _mm256_set1_epi8('\n');
+        for (; i + 32 <= length; i += 32)
+        {
+            const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buffer + i));
+            for (auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline))); mask;
+                 mask &= mask - 1)
+            {
+                newlines.push_back(i + __builtin_ctz(mask));
+            }
+        }
+#elif defined(__SSE2__)
+        const auto newline = _mm_set1_epi8('\n');
+        for (; i + 16 <= length; i += 16)
+        {
+            const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + i));
+            for (auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline))); mask;
+                 mask &= mask - 1)
+            {
+                newlines.push_back(i + __builtin_ctz(mask));
+            }
+        }
+#endif
+        for (; i < length; i++)
+        {
+            if (buffer[i] == '\n') newlines.push_back(i);
+        }
+        index->indexed = length;
+        return *index;
+    }
+
+    // data returns the characters, wherever they are: on the heap, or in the object's own inline array.
+    char* data()
+    {
+        return on_heap ? heap.buffer : local.buffer;
+    }
+
+    const char* data() const
+    {
+        return on_heap ? heap.buffer : local.buffer;
+    }
+
+    size_t max_size() const
+    {
+        return on_heap ? heap.max_size : local.max_size;
+    }
+
+    // take copies other's heap pointer and max_size, or all of its inline array, whichever it uses, and
+    // leaves other empty. The caller has already copied length and the flags.
+    void take(SimpleString& other) noexcept
+    {
+        if (on_heap)
+        {
+            heap = other.heap;
+        }
+        else
+        {
+            local = other.local;
+        }
+        other.reset();
+    }
+
+    // reset leaves a moved-from string empty, without a heap buffer and without room to append to.
+    void reset() noexcept
+    {
+        on_heap = false;
+        local.buffer[0] = 0;
+        local.max_size = 0;
+        length = 0;
+        growable = false;
+        index.reset();
+    }
+
+    /* Small-string optimization: a short log record, up to 21 characters, fits in 23 with its newline and
+     * null byte. Strings with a max_size up to inline_size keep their characters in local.buffer, inside
+     * the SimpleString itself, and never allocate. Like a std::string, the inline array shares its memory
+     * with the heap buffer's pointer and max_size, which an inline string doesn't need, and on_heap tells
+     * which of the two is in use. The two flags share a word with length, so all of that takes 32 bytes.
+     */
+    static const size_t inline_size{ 23 };
+    size_t length : 62;
+    size_t growable : 1;
+    size_t on_heap : 1;
+    union
+    {
+        struct
+        {
+            char* buffer;
+            size_t max_size;
+        } heap;
+        struct
+        {
+            char buffer[inline_size];
+            unsigned char max_size;
+        } local;
+    };
+    // index is the line index for line_count and line, or null until one of them is first called.
+    mutable std::unique_ptr<LineIndex> index;
 };
 
 struct SimpleStringOwner
@@ -144,8 +451,104 @@ private:
     SimpleString string;
 };
 
-int main()
+/*
+ * append_benchmark appends n_lines lines to one large SimpleString through each of the append_line overloads,
+ * and prints how long a line took on average, over the first and over the last tenth of the lines. Appending
+ * costs the same no matter how long the string already is, so the two should be about equal. The last run
+ * starts a growable string at a single character, and lets it reallocate as it goes.
+ */
+void append_benchmark(size_t n_lines)
+{
+    const char line[]{"2021-03-22 12:00:00 INFO request served in 12 ms"};
+    const auto line_length = sizeof(line) - 1;
+    const auto time = [&](const char* name, SimpleString string, auto append)
+    {
+        const auto tenth = n_lines / 10;
+        std::chrono::duration<double, std::nano> first{}, last{};
+        for (size_t part{}; part < 10; part++)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t i{}; i < tenth; i++)
+            {
+                if (!append(string)) printf("%s: a line didn't fit.\n", name);
+            }
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            if (part == 0) first = elapsed;
+            if (part == 9) last = elapsed;
+        }
+        printf("%-22s %8.1f ns per line at first, %8.1f ns per line at the end\n", name, first.count() / tenth,
+               last.count() / tenth);
+    };
+    printf("Appending %zu lines of %zu characters:\n", n_lines, line_length);
+    const auto max_size = n_lines * (line_length + 1) + 1;
+    time("null-terminated", SimpleString{max_size}, [&](SimpleString& string) { return string.append_line(line); });
+    time("string_view", SimpleString{max_size},
+         [&](SimpleString& string) { return string.append_line(std::string_view{line, line_length}); });
+    time("pointer and length", SimpleString{max_size},
+         [&](SimpleString& string) { return string.append_line(line, line_length); });
+    time("growable", SimpleString{1, SimpleString::Mode::growable},
+         [&](SimpleString& string) { return string.append_line(line, line_length); });
+}
+
+/*
+ * line_benchmark builds a text of n_lines lines of different lengths, and times building its line index,
+ * looking lines up through the index, and finding lines by rescanning the text for newlines with memchr,
+ * which is what every lookup would cost without the index. Finally, it appends one more line and times
+ * bringing the index up to date, which only scans that line.
+ */
+void line_benchmark(size_t n_lines)
+{
+    const char text[]{"2021-03-22 12:00:00 INFO request served in 12 ms, with a few more words on some lines"};
+    SimpleString string{1, SimpleString::Mode::growable};
+    for (size_t i{}; i < n_lines; i++) string.append_line(text, 30 + i * 7 % 50);
+    const auto time = [](auto function)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        function();
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    };
+    size_t count{}, total{};
+    printf("Building the index of %zu lines: %.2f ms\n", n_lines, time([&] { count = string.line_count(); }) / 1e6);
+    const size_t n_lookups{ 1'000'000 };
+    const auto indexed = time([&]
+    {
+        for (size_t i{}; i < n_lookups; i++) total += string.line(i * 7919 % count).size();
+    });
+    printf("Looking up a line through the index: %.1f ns\n", indexed / n_lookups);
+    const size_t n_rescans{ 100 };
+    const auto rescanned = time([&]
+    {
+        const auto first = string.line(0).data();
+        const auto end = string.line(count - 1).data() + string.line(count - 1).size() + 1;
+        for (size_t i{}; i < n_rescans; i++)
+        {
+            auto p = first;
+            for (auto n = i * 7919 % count; n; n--) p = static_cast<const char*>(std::memchr(p, '\n', end - p)) + 1;
+            total += static_cast<const char*>(std::memchr(p, '\n', end - p)) - p;
+        }
+    });
+    printf("Finding a line by rescanning:        %.1f ns\n", rescanned / n_rescans);
+    string.append_line("One more line.");
+    printf("Updating the index after an append:  %.1f ns\n", time([&] { count = string.line_count(); }));
+    printf("(%zu lines, %zu characters looked up)\n", count, total);
+}
+
+// Run with "append" as the first argument, and optionally a number of lines, to run append_benchmark instead,
+// or with "lines" to run line_benchmark.
+int main(int argc, char* argv[])
 {
+    if (argc > 1 && std::strcmp(argv[1], "append") == 0)
+    {
+        append_benchmark(argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100'000);
+        return 0;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "lines") == 0)
+    {
+        line_benchmark(argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100'000);
+        return 0;
+    }
+
     Groucho groucho;
     try
     {
@@ -168,6 +571,31 @@ int main()
     {
         printf("String was not big enough to append another message.");
     }
+    // the line index finds any line of a string without scanning it again.
+    printf("\nB has %zu lines, and the third one is \"%.*s\"", string.line_count(),
+           static_cast<int>(string.line(2).size()), string.line(2).data());
+    // a growable string makes room for Galactica! instead.
+    SimpleString growing{115, SimpleString::Mode::growable};
+    growing.append_line("Grab your gun and bring the cat in.");
+    growing.append_line("Aye-aye sir, coming home.");
+    growing.append_line("Starbuck, whadya hear?");
+    growing.append_line("Nothing' but the rain..");
+    if (growing.append_line("Galactica!") && growing.shrink_to_fit())
+    {
+        growing.print("\nC");
+    }
+
+    // a string can append its own lines, even when that makes it grow: out of its inline array here, and
+    // then into a bigger heap buffer.
+    SimpleString echo{20, SimpleString::Mode::growable};
+    echo.append_line("Hello?");
+    for (size_t i{}; i < 5; i++) echo.append_line(echo.line(i));
+    echo.print("echo");
+    SimpleString chorus{20, SimpleString::Mode::growable};
+    chorus.append_line("Anybody?");
+    chorus.append_lines({chorus.line(0), chorus.line(0)});
+    chorus.append_lines({chorus.line(0), chorus.line(1), chorus.line(2)});
+    chorus.print("chorus");
 
     //SimpleStringOwner x{"x"};
     printf("x is alive\n");
@@ -179,5 +607,22 @@ int main()
     //a_copy.append_line("incontinence.");
     a.print("a");
     //a_copy.print("a_copy");
+
+    // append_lines appends several lines at once, or none of them if they don't all fit.
+    if (!a.append_lines({"Please remain calm.", "A reply will never come."}))
+    {
+        a.print("a is unchanged");
+    }
+    a.append_lines({"Thank you."});
+    a.print("a");
+
+    // a short string keeps its characters inline, so it never allocates. Moving it copies them over,
+    // and leaves the moved-from string empty.
+    SimpleString tiny{20};
+    tiny.append_line("Short and sweet.");
+    SimpleString moved{std::move(tiny)};
+    moved.print("moved");
+    tiny.print("tiny");
+    printf("\n");
 }
 
@@ -0,0 +1,1536 @@
+// heap.hpp holds the Bucket and Heap classes built up in overloadedNewOperator.cpp, along with the ThreadCache that
+// sits in front of a Heap, so other programs, like allocator_benchmark.cpp, can use the same heap. Arena hands out
+// memory for objects that all die at once, and HeapResource lets std::pmr containers use a Heap without replacing
+// operator new. FaultCounter checks that code running on a Heap in the real-time mode never waited for the kernel.
+
+#ifndef CRASH_COURSE_HEAP_HPP
+#define CRASH_COURSE_HEAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory_resource>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Bucket class is responsible for taking up space in memory. As an homage to the Windows heap manager, the bucket
+// size is hardcoded to 4096. All of the management logic goes into the heap class.
+struct Bucket
+{
+    const static size_t data_size{ 4096 };
+    std::byte data[data_size];
+};
+
+// Handing out a whole 4096-byte Bucket for every new char wastes over 99% of the memory. Instead, Heap sorts requests
+// into size classes of 16, 32, 64, ..., 4096 bytes. A Bucket loaned out to a size class is carved into equally sized
+// slots of that class, so sixteen-byte objects share a Bucket 256 to a slab. Only the 4096-byte class still takes a
+// whole Bucket per object.
+// Rather than a fixed array of Buckets, Heap reserves a large range of addresses up front and maps chunks of pages
+// into it with mmap as it runs out of Buckets. Because the range never moves, growing never invalidates a pointer the
+// heap has already handed out, and a Bucket's index is still a simple offset from the start of the range.
+// Requests too big for a Bucket, like the storage of a large std::vector, get page-aligned memory mapped just for them.
+// Heap is safe to use from many threads at once. Each size class has its own lock, so threads allocating different
+// sizes don't wait for one another. The pool of free Buckets they all share is a stack that can run lock-free. Most
+// threads won't touch any of this on the common path: see ThreadCache below.
+struct Heap {
+
+    // allocate first checks whether the number of bytes requested is greater than the bucket size. If it is, it hands
+    // the request to allocate_large. Otherwise, it rounds the request up to the smallest size class that fits and takes
+    // a single slot with allocate_batch.
+    // Every size class is a power of two, and every Bucket starts on a page boundary, so every slot is aligned to its
+    // own size. A request for memory with a stricter alignment than usual, for an over-aligned type, is simply rounded
+    // up to a size class at least as big as its alignment.
+    void* allocate(size_t bytes, size_t alignment = default_alignment)
+    {
+        const auto rounded = bytes < alignment ? alignment : bytes;
+        if (rounded > Bucket::data_size)
+        {
+            const auto result = allocate_large(bytes, alignment);
+            shared_stats.count_allocation(n_size_classes, bytes);
+            return result;
+        }
+        void* slot{};
+        allocate_batch(size_class(rounded), &slot, 1);
+        shared_stats.count_allocation(size_class(rounded), bytes);
+        return slot;
+    }
+
+    // free works out which Bucket p points into from its offset into buckets, so it doesn't need to compare p against
+    // every Bucket either, and a delete costs the same no matter how many Buckets the heap has. The Bucket's entry in
+    // bucket_info says which size class it was carved into, and free_batch gives the slot back to that class.
+    // Pointers outside buckets are either large allocations, which carry a LargeHeader, or were never handed out by
+    // this heap, in which case they go to fallback_free instead of being silently dropped. Pointers into buckets that
+    // aren't the start of a slot the heap has carved out are ignored. A slot that has been carved out and freed again
+    // looks no different from one still loaned out, though, so freeing a pointer twice is as undefined as with malloc.
+    void free(void* p)
+    {
+        if (!owns(p))
+        {
+            free_outside(p, false);
+            return;
+        }
+        const auto c = slot_class(p);
+        if (c == n_size_classes) return;
+        free_batch(c, &p, 1);
+        shared_stats.count_free();
+    }
+
+    // This free is for sized deallocation, where the caller passes along the size, and the alignment if there was one,
+    // that p was allocated with. They alone tell which size class p belongs to, so there is no need to look p up in
+    // bucket_info. The compiler emits a sized delete for any ordinary delete of a complete type, though, including one
+    // of memory that came from somewhere else, so p is still checked against the range first. That is only two
+    // comparisons. Only a large allocation with a stricter alignment is trusted to carry a LargeHeader wherever it sits.
+    // A p inside the range must have come from allocate with exactly that size and alignment.
+    void free(void* p, size_t bytes, size_t alignment = default_alignment)
+    {
+        const auto rounded = bytes < alignment ? alignment : bytes;
+        if (!owns(p))
+        {
+            free_outside(p, rounded > Bucket::data_size && alignment > default_alignment);
+            return;
+        }
+        free_batch(size_class(rounded), &p, 1);
+        shared_stats.count_free();
+    }
+
+    // free_aligned frees p, which was allocated with a stricter alignment than usual, when its size isn't known.
+    void free_aligned(void* p)
+    {
+        if (owns(p)) free(p);
+        else free_outside(p, true);
+    }
+
+    // allocate_batch takes up to n slots of size class c and stores them in slots, returning how many it took. Requests
+    // for a whole Bucket take them straight from take_bucket. Smaller requests take slots from Buckets of their size
+    // class that still have room, carving fresh Buckets into slots when there aren't any. Taking a whole batch under one
+    // lock is what lets ThreadCache refill cheaply. If the heap can't supply a single slot, it throws std::bad_alloc.
+    // Every Bucket the slots come from is marked as belonging to owner, the ThreadCache taking them, if any.
+    size_t allocate_batch(size_t c, void** slots, size_t n, uint16_t owner = 0)
+    {
+        size_t taken{};
+        if (c == whole_bucket_class)
+        {
+            for (; taken < n; taken++)
+            {
+                const auto bucket = take_bucket(c);
+                if (!bucket) break;
+                bucket_owner[bucket - buckets].store(owner, std::memory_order_relaxed);
+                slots[taken] = bucket->data;
+            }
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock{ class_lock[c] };
+            while (taken < n)
+            {
+                if (!partial[c])
+                {
+                    const auto bucket = take_bucket(c);
+                    if (!bucket) break;
+                    push_partial(bucket_index(bucket) + 1);
+                }
+                const auto i = partial[c];
+                auto& info = bucket_info[i - 1];
+                bucket_owner[i - 1].store(owner, std::memory_order_relaxed);
+                while (taken < n && info.live < slots_per_bucket(c))
+                {
+                    if (info.free_slots)
+                    {
+                        slots[taken++] = info.free_slots;
+                        info.free_slots = info.free_slots->next;
+                    }
+                    else
+                    {
+                        const auto k = info.n_fresh.load(std::memory_order_relaxed);
+                        info.n_fresh.store(k + 1, std::memory_order_relaxed);
+                        slots[taken++] = buckets[i - 1].data + k * slot_size(c);
+                    }
+                    info.live++;
+                }
+                if (info.live == slots_per_bucket(c)) remove_partial(i);
+            }
+        }
+        if (taken == 0)
+        {
+            failed_allocations.fetch_add(1, std::memory_order_relaxed);
+            throw std::bad_alloc{};
+        }
+        return taken;
+    }
+
+    // free_batch gives n slots of size class c back to the heap. Whole Buckets go straight back onto the free list. A
+    // slot goes onto its Bucket's own list of free slots, and once every slot in the Bucket is free again, the whole
+    // Bucket goes back onto the free list, ready to be carved into a different size class.
+    void free_batch(size_t c, void* const* slots, size_t n)
+    {
+        if (c == whole_bucket_class)
+        {
+            for (size_t k{}; k < n; k++) release_bucket(bucket_index(slots[k]));
+            return;
+        }
+        std::lock_guard<std::mutex> lock{ class_lock[c] };
+        for (size_t k{}; k < n; k++)
+        {
+            const auto i = bucket_index(slots[k]);
+            auto& info = bucket_info[i];
+            info.free_slots = new(slots[k]) FreeSlot{ info.free_slots };
+            if (info.live-- == slots_per_bucket(c)) push_partial(i + 1);
+            if (info.live == 0)
+            {
+                remove_partial(i + 1);
+                release_bucket(i);
+            }
+        }
+    }
+
+    // owns tells whether p points into the range reserved for buckets. It takes no lock.
+    bool owns(const void* p) const
+    {
+        const auto address = static_cast<const std::byte*>(p);
+        const auto first = range.load(std::memory_order_acquire);
+        return first && address >= first && address < first + max_reserved_buckets * sizeof(Bucket);
+    }
+
+    // owner_of returns which ThreadCache the Bucket p points into belongs to, or zero if none does. p must point into a
+    // loaned out Bucket.
+    uint16_t owner_of(const void* p) const
+    {
+        return bucket_owner[bucket_index(p)].load(std::memory_order_relaxed);
+    }
+
+    // In a pipeline, one thread allocates messages and another frees them. If the freeing thread kept the slots in its
+    // own ThreadCache, they would pile up there, while the allocating thread kept taking new ones from the heap under a
+    // class_lock. Instead, every ThreadCache claims an owner number, and every Bucket remembers the owner that last took
+    // slots from it. A thread that frees a slot owned by another thread pushes it onto that owner's RemoteQueue, with a
+    // single compare-and-swap, and the owner reclaims everything in its queue at once, the next time it would otherwise
+    // have to refill from the heap. That way the slot goes back to the thread that will reuse it, and whose cache it is
+    // likely still in. Any number of threads push onto a RemoteQueue, but only one takes from it, and it always takes the
+    // whole list with one exchange, so there is no ABA problem.
+    // The queues belong to the heap rather than to the ThreadCaches, because a thread's cache goes away when it exits
+    // while other threads may still be freeing its slots. When a thread exits, its owner number goes inactive, and
+    // whatever is still or later pushed to it goes back to the heap.
+    struct RemoteSlot
+    {
+        RemoteSlot* next;
+        size_t size_class;
+    };
+
+    struct alignas(64) RemoteQueue
+    {
+        std::atomic<RemoteSlot*> head;
+        std::atomic<bool> active;
+    };
+    static const size_t max_owners{ 256 };
+
+    // claim_owner hands out an owner number that isn't in use, or zero if they all are, in which case the ThreadCache
+    // simply gets no remote frees. Anything left in the queue from its last owner goes back to the heap.
+    uint16_t claim_owner()
+    {
+        if (!remote_frees.load(std::memory_order_relaxed)) return 0;
+        std::lock_guard<std::mutex> lock{ stats_lock };
+        for (uint16_t owner{ 1 }; owner < max_owners; owner++)
+        {
+            auto& queue = remote_queues[owner];
+            if (queue.active.load(std::memory_order_relaxed)) continue;
+            queue.active.store(true);
+            free_remote(queue.head.exchange(nullptr));
+            return owner;
+        }
+        return 0;
+    }
+
+    void release_owner(uint16_t owner)
+    {
+        if (!owner) return;
+        std::lock_guard<std::mutex> lock{ stats_lock };
+        auto& queue = remote_queues[owner];
+        queue.active.store(false);
+        free_remote(queue.head.exchange(nullptr));
+    }
+
+    // push_remote pushes p, a slot of size class c, onto owner's queue. If the owner has gone inactive in the meantime,
+    // the pusher empties the queue back into the heap itself. Together with release_owner, which marks the owner
+    // inactive before it empties the queue, that makes sure no slot is left behind in it.
+    void push_remote(uint16_t owner, void* p, size_t c)
+    {
+        auto& queue = remote_queues[owner];
+        const auto slot = new(p) RemoteSlot{ nullptr, c };
+        auto head = queue.head.load(std::memory_order_relaxed);
+        do
+        {
+            slot->next = head;
+        }
+        while (!queue.head.compare_exchange_weak(head, slot, std::memory_order_seq_cst, std::memory_order_relaxed));
+        if (!queue.active.load()) free_remote(queue.head.exchange(nullptr));
+    }
+
+    // take_remote empties owner's queue and returns the slots that were in it.
+    RemoteSlot* take_remote(uint16_t owner)
+    {
+        auto& queue = remote_queues[owner];
+        if (!queue.head.load(std::memory_order_relaxed)) return nullptr;
+        return queue.head.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    // Remote frees can be switched off, before the first allocation, to compare against.
+    void set_remote_frees(bool enabled)
+    {
+        remote_frees.store(enabled, std::memory_order_relaxed);
+    }
+
+    // slot_class returns the size class of the slot p points to, or n_size_classes if p isn't the start of a slot that
+    // has been carved out of a loaned out Bucket. p must be owned by the heap. It takes no lock: the size class of a
+    // Bucket doesn't change while any of its slots is loaned out, and a slot that was handed out to the caller was
+    // carved before that.
+    size_t slot_class(const void* p) const
+    {
+        const auto i = bucket_index(p);
+        if (i >= n_mapped.load(std::memory_order_acquire) || !is_used(i)) return n_size_classes;
+        const auto& info = bucket_info[i];
+        const auto c = info.size_class;
+        const size_t offset = static_cast<const std::byte*>(p) - buckets[i].data;
+        if (offset % slot_size(c) != 0) return n_size_classes;
+        if (c != whole_bucket_class && offset >= info.n_fresh.load(std::memory_order_relaxed) * slot_size(c))
+        {
+            return n_size_classes;
+        }
+        return c;
+    }
+
+    // A FreeSlot lives inside a slot that has been freed, and points at the next free slot in the same Bucket. Every
+    // size class is at least 16 bytes, so there's always room for it.
+    struct FreeSlot
+    {
+        FreeSlot* next;
+    };
+
+    // A LargeHeader sits in the sixteen bytes right before every large allocation. It records how many bytes were
+    // mapped, starting from the page the header is on, so free can unmap them again. check holds the allocation's own
+    // address scrambled with a magic number, which tells a genuine LargeHeader apart from whatever happens to sit before
+    // a foreign pointer.
+    struct LargeHeader
+    {
+        size_t mapped_bytes;
+        size_t check;
+    };
+
+    // BucketInfo is the bookkeeping for a loaned out Bucket. It lives in a side table rather than in the Bucket, so
+    // slots can start right at the beginning of the Bucket's data. Buckets of the same size class that still have free
+    // slots are chained together through prev and next, which hold a Bucket's index plus one (zero ends the chain).
+    // n_fresh counts the slots carved out of the Bucket so far. It is atomic only so that slot_class can read it
+    // without taking the class_lock that guards it.
+    static const uint64_t purged{ UINT64_MAX };
+    struct BucketInfo
+    {
+        size_t size_class;
+        size_t live;
+        std::atomic<size_t> n_fresh;
+        FreeSlot* free_slots;
+        size_t prev;
+        size_t next;
+        // freed_at is only used while the Bucket is free. It holds when the Bucket was released, in steady_clock
+        // nanoseconds, or purged once its pages have been given back to the system.
+        uint64_t freed_at;
+    };
+
+    static const size_t min_slot_size{ 16 };
+    static const size_t n_size_classes{ 9 };
+    static const size_t whole_bucket_class{ n_size_classes - 1 };
+    // default_alignment is what plain operator new promises. Stricter alignments come with a std::align_val_t.
+    static const size_t default_alignment{ alignof(std::max_align_t) };
+    static_assert((min_slot_size << whole_bucket_class) == Bucket::data_size, "The largest size class is a whole Bucket.");
+    static_assert(sizeof(RemoteSlot) <= min_slot_size, "Every slot has room for a RemoteSlot.");
+
+    // size_class finds the smallest size class that can hold bytes.
+    static size_t size_class(size_t bytes)
+    {
+        size_t c{};
+        while (slot_size(c) < bytes) c++;
+        return c;
+    }
+    static size_t slot_size(size_t c)
+    {
+        return min_slot_size << c;
+    }
+    static size_t slots_per_bucket(size_t c)
+    {
+        return Bucket::data_size / slot_size(c);
+    }
+
+    // in_use counts the Buckets that are currently loaned out, whether whole or carved into slots, by counting the bits
+    // set in bucket_used a word at a time.
+    size_t in_use() const
+    {
+        size_t result{};
+        const auto n_words = n_mapped.load(std::memory_order_acquire) / 64;
+        for (size_t w{}; w < n_words; w++) result += __builtin_popcountll(bucket_used[w].load(std::memory_order_relaxed));
+        return result;
+    }
+
+    bool is_used(size_t i) const
+    {
+        return bucket_used[i / 64].load(std::memory_order_acquire) >> (i % 64) & 1;
+    }
+
+    // find_free returns the index of the first Bucket at or after from that isn't loaned out, or n_mapped if there isn't
+    // one. Inverting a word of bucket_used turns its free Buckets into set bits, and counting the trailing zeros finds
+    // the lowest of them in a single instruction. Words with every Bucket in use are skipped several at a time with SIMD
+    // comparisons, so even a heap with tens of thousands of Buckets is searched in a handful of cache lines. Other
+    // threads may be allocating while it runs, so the answer is a snapshot.
+    size_t find_free(size_t from) const
+    {
+        const auto n_words = n_mapped.load(std::memory_order_acquire) / 64;
+        auto w = from / 64;
+        if (w >= n_words) return n_words * 64;
+        auto free_bits = ~bucket_used[w].load(std::memory_order_relaxed) & (~uint64_t{} << (from % 64));
+        while (!free_bits)
+        {
+            if (++w >= n_words) return n_words * 64;
+            w = skip_words(reinterpret_cast<const uint64_t*>(bucket_used), w, n_words, ~uint64_t{});
+            if (w >= n_words) return n_words * 64;
+            free_bits = ~bucket_used[w].load(std::memory_order_relaxed);
+        }
+        return w * 64 + __builtin_ctzll(free_bits);
+    }
+
+    // Stats counts allocations, the bytes requested by them, and frees. Allocations are counted by size class, with
+    // large allocations in the last entry, which makes a histogram of requested sizes. Every ThreadCache keeps a Stats
+    // of its own that only its thread writes to, so counting takes a plain load and store rather than a locked
+    // instruction, and threads never fight over the same cache line. The heap keeps one more, shared_stats, for
+    // allocations made on it directly. Any thread may write to that one, so it is marked shared and counts with a locked
+    // instruction after all. The counters are atomics only so that snapshot can read them while they change.
+    struct Stats
+    {
+        void count_allocation(size_t c, size_t bytes)
+        {
+            add(allocations[c], 1);
+            add(requested_bytes[c], bytes);
+        }
+        void count_free()
+        {
+            add(frees, 1);
+        }
+        void count_remote_free()
+        {
+            add(frees, 1);
+            add(remote_frees, 1);
+        }
+
+        std::atomic<uint64_t> allocations[n_size_classes + 1];
+        std::atomic<uint64_t> requested_bytes[n_size_classes + 1];
+        std::atomic<uint64_t> frees;
+        std::atomic<uint64_t> remote_frees;
+        // The Stats of every thread are chained together, under stats_lock, so snapshot can find them.
+        Stats* next;
+        Stats* prev;
+        bool shared;
+
+    private:
+        void add(std::atomic<uint64_t>& counter, uint64_t n)
+        {
+            if (shared) counter.fetch_add(n, std::memory_order_relaxed);
+            else counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    };
+
+    // A StatsSnapshot is a copy of every counter, summed over all threads.
+    struct StatsSnapshot
+    {
+        uint64_t allocations[n_size_classes + 1];
+        uint64_t requested_bytes[n_size_classes + 1];
+        uint64_t frees;
+        uint64_t remote_frees;
+        uint64_t failed_allocations;
+        uint64_t live_buckets;
+        uint64_t peak_buckets;
+        uint64_t huge_page_chunks;
+        uint64_t transparent_huge_page_chunks;
+        uint64_t purged_buckets;
+    };
+
+    // attach adds a thread's Stats to the ones snapshot sums up. detach takes it away again when the thread exits,
+    // adding its counts to shared_stats so they aren't lost.
+    void attach(Stats& stats)
+    {
+        std::lock_guard<std::mutex> lock{ stats_lock };
+        stats.prev = nullptr;
+        stats.next = thread_stats;
+        if (thread_stats) thread_stats->prev = &stats;
+        thread_stats = &stats;
+    }
+
+    void detach(Stats& stats)
+    {
+        std::lock_guard<std::mutex> lock{ stats_lock };
+        if (stats.prev) stats.prev->next = stats.next;
+        else thread_stats = stats.next;
+        if (stats.next) stats.next->prev = stats.prev;
+        for (size_t c{}; c <= n_size_classes; c++)
+        {
+            shared_stats.allocations[c].fetch_add(stats.allocations[c].load(std::memory_order_relaxed));
+            shared_stats.requested_bytes[c].fetch_add(stats.requested_bytes[c].load(std::memory_order_relaxed));
+        }
+        shared_stats.frees.fetch_add(stats.frees.load(std::memory_order_relaxed));
+        shared_stats.remote_frees.fetch_add(stats.remote_frees.load(std::memory_order_relaxed));
+    }
+
+    // snapshot sums up every thread's counters. Each counter is read on its own, so a snapshot taken while other
+    // threads allocate is only approximately consistent, which is plenty for watching a heap in production.
+    StatsSnapshot snapshot() const
+    {
+        StatsSnapshot result{};
+        const auto add = [&result](const Stats& stats)
+        {
+            for (size_t c{}; c <= n_size_classes; c++)
+            {
+                result.allocations[c] += stats.allocations[c].load(std::memory_order_relaxed);
+                result.requested_bytes[c] += stats.requested_bytes[c].load(std::memory_order_relaxed);
+            }
+            result.frees += stats.frees.load(std::memory_order_relaxed);
+            result.remote_frees += stats.remote_frees.load(std::memory_order_relaxed);
+        };
+        {
+            std::lock_guard<std::mutex> lock{ stats_lock };
+            for (auto stats = thread_stats; stats; stats = stats->next) add(*stats);
+            add(shared_stats);
+        }
+        result.failed_allocations = failed_allocations.load(std::memory_order_relaxed);
+        result.live_buckets = live_buckets.load(std::memory_order_relaxed);
+        result.peak_buckets = peak_buckets.load(std::memory_order_relaxed);
+        result.huge_page_chunks = huge_page_chunks.load(std::memory_order_relaxed);
+        result.transparent_huge_page_chunks = transparent_huge_page_chunks.load(std::memory_order_relaxed);
+        result.purged_buckets = purged_buckets.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    // dump_stats prints a snapshot. For every size class, it shows how many bytes were requested, how many the slots
+    // handed out for them hold, and how many a whole Bucket per allocation would have taken, so the waste from rounding
+    // up is plain to see.
+    void dump_stats(FILE* file) const
+    {
+        const auto stats = snapshot();
+        uint64_t allocations{};
+        for (auto n : stats.allocations) allocations += n;
+        fprintf(file, "Heap statistics\n");
+        fprintf(file, "  live Buckets:       %llu (peak %llu)\n", ull(stats.live_buckets), ull(stats.peak_buckets));
+        fprintf(file, "  allocations:        %llu\n", ull(allocations));
+        fprintf(file, "  frees:              %llu\n", ull(stats.frees));
+        if (stats.remote_frees) fprintf(file, "  remote frees:       %llu\n", ull(stats.remote_frees));
+        if (stats.purged_buckets) fprintf(file, "  purged Buckets:     %llu\n", ull(stats.purged_buckets));
+        if (stats.huge_page_chunks)
+        {
+            fprintf(file, "  huge page chunks:   %llu (%llu transparent)\n", ull(stats.huge_page_chunks),
+                    ull(stats.transparent_huge_page_chunks));
+        }
+        fprintf(file, "  failed allocations: %llu\n", ull(stats.failed_allocations));
+        fprintf(file, "  size class  allocations  requested bytes  slot bytes (waste)   whole Bucket bytes (waste)\n");
+        for (size_t c{}; c <= n_size_classes; c++)
+        {
+            const auto n = stats.allocations[c];
+            if (n == 0) continue;
+            const auto requested = stats.requested_bytes[c];
+            if (c == n_size_classes)
+            {
+                fprintf(file, "  %10s  %11llu  %15llu\n", "large", ull(n), ull(requested));
+                continue;
+            }
+            const auto slot_bytes = n * slot_size(c);
+            const auto bucket_bytes = n * Bucket::data_size;
+            fprintf(file, "  %10zu  %11llu  %15llu  %10llu (%5.1f%%)  %18llu (%5.1f%%)\n", slot_size(c), ull(n),
+                    ull(requested), ull(slot_bytes), 100.0 * (slot_bytes - requested) / slot_bytes, ull(bucket_bytes),
+                    100.0 * (bucket_bytes - requested) / bucket_bytes);
+        }
+    }
+
+    // The shared pool of free Buckets is a stack that every thread pushes freed Buckets onto and pops them off. In the
+    // lock_free mode, threads push and pop with a compare-and-swap loop and never wait for one another. In the mutex
+    // mode, they run the very same loop while holding pool_lock, which serializes them. Both modes can be switched at
+    // any time. The mutex mode is the default, and mostly serves as a baseline to measure the lock_free mode against.
+    enum class PoolMode
+    {
+        mutex,
+        lock_free
+    };
+
+    void set_pool_mode(PoolMode mode)
+    {
+        pool_mode.store(mode, std::memory_order_relaxed);
+    }
+
+    // set_max_buckets caps how many Buckets the heap will ever hand out. Once the cap is reached, allocate throws
+    // std::bad_alloc, just as the fixed ten-Bucket heap did. The cap can't exceed the reserved range. It can also be set
+    // for a whole process with the HEAP_MAX_BUCKETS environment variable, which is read when the range is reserved.
+    void set_max_buckets(size_t n)
+    {
+        std::lock_guard<std::mutex> lock{ pool_lock };
+        max_buckets = n < max_reserved_buckets ? n : max_reserved_buckets;
+    }
+
+    // Every Bucket sits on a 4096-byte page of its own, and the processor's TLB only remembers where so many pages are,
+    // so a program that hops between many Buckets keeps missing in it. In the huge mode, the heap maps its chunks of
+    // Buckets from 2 MiB huge pages instead, each of which covers 512 Buckets with a single TLB entry. It first asks
+    // for huge pages the system has set aside (MAP_HUGETLB). If there are none to spare, it maps ordinary pages and asks
+    // the kernel to back them with transparent huge pages (MADV_HUGEPAGE) where it can. If neither works, the chunk
+    // simply stays on ordinary pages. The mode applies to chunks mapped after it's set, and can also be set for a whole
+    // process with the HEAP_HUGE_PAGES environment variable. The bookkeeping always stays on ordinary pages.
+    enum class PageMode
+    {
+        normal,
+        huge
+    };
+
+    void set_page_mode(PageMode mode)
+    {
+        std::lock_guard<std::mutex> lock{ pool_lock };
+        page_mode = mode;
+    }
+
+    // The heap never unmaps a Bucket, so after a burst of allocations is over, the Buckets it freed would stay resident
+    // for good. purge gives the pages of free Buckets that nobody has used for at least the decay time back to the
+    // system with madvise. The addresses stay mapped, and the next time such a Bucket is handed out, its pages come back
+    // filled with zeros the first time they are touched. Buckets freed more recently than that are likely to be needed
+    // again soon, and are left alone so they don't have to be faulted back in. Consecutive Buckets are purged together,
+    // with one madvise for the whole run. In the dont_need mode (MADV_DONTNEED) the pages are gone right away. In the
+    // free mode (MADV_FREE) the kernel only takes them once it runs short of memory, which is cheaper if they are reused
+    // before that, but the resident set doesn't shrink until then. Once any chunk sits on huge pages, only whole huge
+    // pages are purged, so none of them is split up.
+    // purge only runs when it's called, from a thread on a timer or whenever the program knows it's idle, and returns
+    // how many Buckets it purged. The decay time can also be set for a whole process with the HEAP_PURGE_DECAY_MS
+    // environment variable.
+    enum class PurgeMode
+    {
+        dont_need,
+        free
+    };
+
+    void set_purge_mode(PurgeMode mode)
+    {
+        purge_mode.store(mode, std::memory_order_relaxed);
+    }
+
+    void set_purge_decay(std::chrono::milliseconds decay)
+    {
+        purge_decay_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(decay).count(),
+                             std::memory_order_relaxed);
+    }
+
+    // purge takes the whole stack of free Buckets at once, so no thread can pop one of them while it is being purged. It
+    // splits the stack into the Buckets that are still resident and the ones that are idle or were purged before,
+    // marking the idle ones in purge_marks, and pushes the resident ones straight back. Only then does it purge the runs
+    // of marked Buckets. Afterwards the idle Buckets go back underneath whatever is on the stack by then, so the ones
+    // still in memory are handed out first. A thread that finds the stack empty while a purge is running waits for it
+    // in take_bucket rather than growing the heap, or failing, while every Bucket might be free.
+    size_t purge()
+    {
+        if (!range.load(std::memory_order_acquire) || real_time.load(std::memory_order_relaxed)) return 0;
+        std::lock_guard<std::mutex> purging{ purge_lock };
+        purge_generation.fetch_add(1, std::memory_order_relaxed);
+        const auto now = now_ns();
+        const auto decay = purge_decay_ns.load(std::memory_order_relaxed);
+        size_t resident{}, resident_last{}, idle{}, idle_last{};
+        for (auto i = take_free(); i;)
+        {
+            const auto next = bucket_next[i - 1].load(std::memory_order_relaxed);
+            const auto freed_at = bucket_info[i - 1].freed_at;
+            const auto is_resident = freed_at != purged && now - freed_at < decay;
+            if (freed_at != purged && !is_resident) purge_marks[(i - 1) / 64] |= uint64_t{ 1 } << (i - 1) % 64;
+            auto& first = is_resident ? resident : idle;
+            auto& last = is_resident ? resident_last : idle_last;
+            if (last) bucket_next[last - 1].store(static_cast<uint32_t>(i), std::memory_order_relaxed);
+            else first = i;
+            last = i;
+            i = next;
+        }
+        if (resident) push_free(resident, resident_last);
+        const auto n_purged = purge_marked();
+        if (idle)
+        {
+            const auto top = take_free();
+            push_free(idle, idle_last);
+            if (top) push_free(top, last_free(top));
+        }
+        purge_generation.fetch_add(1, std::memory_order_release);
+        purged_buckets.fetch_add(n_purged, std::memory_order_relaxed);
+        return n_purged;
+    }
+
+    // A latency-critical thread, like the one running the AutoBrake in testing.cpp, can't afford to wait for the kernel
+    // in the middle of an allocation. In the real-time mode, nothing allocate or free does on the heap ends in a page
+    // fault or a system call. set_real_time maps n_buckets Buckets and their bookkeeping right away, touches every page
+    // so it is resident, and locks them into memory with mlock, so the kernel can't swap them out. From then on, the
+    // heap never grows or purges: once the Buckets are used up, allocate throws std::bad_alloc, and so does any request
+    // too large for a Bucket, which would need a mapping of its own. The pool of free Buckets switches to the lock_free
+    // mode. What is left are the size classes' locks, which only call into the kernel when another thread holds them,
+    // and the first use of each thread's ThreadCache, which ThreadCache::prepare takes care of.
+    // set_real_time is meant to be called once, at startup, before other threads use the heap. It returns false if the
+    // memory couldn't be mapped or locked. Locking takes CAP_IPC_LOCK or a big enough RLIMIT_MEMLOCK (see ulimit -l);
+    // without it, the pages are still touched, but the kernel may take them back under memory pressure.
+    bool set_real_time(size_t n_buckets)
+    {
+        std::lock_guard<std::mutex> lock{ pool_lock };
+        if (n_buckets > max_buckets) n_buckets = max_buckets;
+        if (n_buckets < n_fresh) n_buckets = n_fresh;
+        while (n_mapped.load(std::memory_order_relaxed) < n_buckets)
+        {
+            if (!grow()) return false;
+        }
+        if (!buckets && !reserve()) return false;
+        max_buckets = n_buckets;
+        real_time.store(true, std::memory_order_relaxed);
+        pool_mode.store(PoolMode::lock_free, std::memory_order_relaxed);
+        // Freeing a Bucket reads the clock, and the first read faults in the pages the clock is read from.
+        now_ns();
+        const auto n = n_mapped.load(std::memory_order_relaxed);
+        auto locked = lock_pages(buckets, n * sizeof(Bucket));
+        locked = lock_pages(bucket_info, n * sizeof(BucketInfo)) && locked;
+        locked = lock_pages(bucket_next, n * sizeof(uint32_t)) && locked;
+        locked = lock_pages(bucket_owner, n * sizeof(uint16_t)) && locked;
+        locked = lock_pages(bucket_used, max_reserved_buckets / 4) && locked;
+        return lock_pages(this, sizeof(*this)) && locked;
+    }
+
+    // lock_pages touches every page from address on, and locks them into memory. The first byte of every page is read
+    // and written back, so the page is resident and writable without its contents changing.
+    static bool lock_pages(void* address, size_t bytes)
+    {
+        const auto first = reinterpret_cast<uintptr_t>(address) / page_size * page_size;
+        const auto last = round_up(reinterpret_cast<uintptr_t>(address) + bytes, page_size);
+        for (auto page = first; page < last; page += page_size)
+        {
+            const auto byte = reinterpret_cast<volatile char*>(page);
+            *byte = *byte;
+        }
+        return mlock(reinterpret_cast<void*>(first), last - first) == 0;
+    }
+
+    // The heap reserves room for max_reserved_buckets Buckets (4 GiB of addresses, but no memory) and maps them in
+    // chunk_buckets at a time. The Buckets start on a huge page boundary, and a chunk is a whole number of huge pages.
+    static const size_t max_reserved_buckets{ size_t{ 1 } << 20 };
+    static const size_t chunk_buckets{ 4096 };
+    static const size_t huge_page_size{ size_t{ 2 } << 20 };
+    static_assert(chunk_buckets * sizeof(Bucket) % huge_page_size == 0, "Each chunk fills whole huge pages.");
+    static_assert(max_reserved_buckets % chunk_buckets == 0, "The reserved range is a whole number of chunks.");
+    static_assert(chunk_buckets % 64 == 0, "Each chunk fills whole words of bucket_used.");
+    static_assert(max_reserved_buckets <= UINT32_MAX, "A Bucket's index plus one fits in 32 bits.");
+    static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) && std::atomic<uint64_t>::is_always_lock_free,
+                  "Freshly mapped zero pages hold valid atomics.");
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free,
+                  "Freshly mapped zero pages hold valid atomics.");
+    static_assert(sizeof(std::atomic<uint16_t>) == sizeof(uint16_t) && std::atomic<uint16_t>::is_always_lock_free,
+                  "Freshly mapped zero pages hold valid atomics.");
+    // The buckets member points at the reserved range that houses all the Buckets, neatly packed into a contiguous
+    // string. It stays null until the first allocation reserves the range. range holds the same address, published
+    // for owns, which reads it without taking a lock.
+    Bucket* buckets{};
+    std::atomic<std::byte*> range{};
+    // bucket_used member points at a bitmap that keeps track of whether the Bucket in buckets with the same index has
+    // been loaned out yet: bit i % 64 of word i / 64. At one bit per Bucket, the bitmap for every Bucket the heap could
+    // ever reserve takes 128 KiB, so it is mapped in full up front. Freshly mapped pages are zero, so it starts out with
+    // every Bucket free.
+    std::atomic<uint64_t>* bucket_used{};
+    // purge_marks is a bitmap just like bucket_used, right after it, in which purge marks the Buckets it is about to
+    // purge. Only purge touches it, under purge_lock.
+    uint64_t* purge_marks{};
+    // bucket_next links the free Buckets into a stack: it holds the index plus one of the next free Bucket below the one
+    // with the same index (zero ends the stack). The links live in a side table rather than inside the free Buckets, so
+    // a thread that loses a race to pop a Bucket never reads memory that another thread has already loaned out.
+    std::atomic<uint32_t>* bucket_next{};
+    // bucket_owner holds the owner number of the ThreadCache that last took slots from the Bucket with the same index.
+    std::atomic<uint16_t>* bucket_owner{};
+    // bucket_info points at the size class bookkeeping of each loaned out Bucket, at the same index.
+    BucketInfo* bucket_info{};
+    // n_mapped counts the Buckets that have been mapped so far, and max_buckets caps how many can be handed out.
+    std::atomic<size_t> n_mapped{};
+    size_t max_buckets{ max_reserved_buckets };
+    // partial holds, for each size class, the index plus one of a Bucket that still has free slots.
+    size_t partial[n_size_classes]{};
+    // free_top is the top of the stack of free Buckets. Its low 32 bits hold the index plus one of the most recently freed
+    // Bucket, and its high 32 bits count every push and pop. Because the count changes even when the same Bucket comes
+    // back to the top, a compare-and-swap from a thread that read the top before the Bucket was popped and pushed again
+    // fails instead of corrupting the stack (the ABA problem). Freed Buckets are handed out again last-in, first-out,
+    // which keeps recently touched memory hot in the cache.
+    std::atomic<uint64_t> free_top{};
+    std::atomic<PoolMode> pool_mode{ PoolMode::mutex };
+    PageMode page_mode{ PageMode::normal };
+    std::atomic<PurgeMode> purge_mode{ PurgeMode::dont_need };
+    std::atomic<uint64_t> purge_decay_ns{ 10'000'000'000 };
+    std::atomic<bool> real_time{};
+    // n_fresh counts the Buckets that have been handed out at least once. Buckets at index n_fresh and beyond have never
+    // been used, so Heap can hand them out in order without putting them on the free list first. When n_fresh reaches
+    // n_mapped, Heap maps another chunk.
+    size_t n_fresh{};
+    // Each class_lock guards its size class's entry in partial, along with the bucket_info of every Bucket carved into
+    // that size class. pool_lock guards n_fresh, page_mode and growing the heap, as well as the stack of free Buckets in
+    // the mutex mode. A thread holding a class_lock may take pool_lock, but never the other way around.
+    std::mutex class_lock[n_size_classes];
+    mutable std::mutex pool_lock;
+    // purge_lock keeps purges from running at the same time. A purge takes pool_lock while holding it, but never a
+    // class_lock, so take_bucket may wait on purge_lock while holding a class_lock. purge_generation is odd while a purge
+    // is running, and goes up by two with every purge.
+    std::mutex purge_lock;
+    std::atomic<uint64_t> purge_generation{};
+    // shared_stats counts what isn't counted by a ThreadCache. thread_stats chains together the Stats of every thread
+    // with a ThreadCache, under stats_lock. live_buckets and peak_buckets count the Buckets loaned out now and at most,
+    // and change only when a Bucket is taken or released, which is off the common path.
+    Stats shared_stats{ {}, {}, {}, {}, nullptr, nullptr, true };
+    Stats* thread_stats{};
+    mutable std::mutex stats_lock;
+    std::atomic<uint64_t> failed_allocations{};
+    std::atomic<uint64_t> live_buckets{};
+    // huge_page_chunks counts the chunks mapped from huge pages, and transparent_huge_page_chunks the ones among them
+    // that only asked for transparent huge pages.
+    std::atomic<uint64_t> huge_page_chunks{};
+    std::atomic<uint64_t> transparent_huge_page_chunks{};
+    std::atomic<uint64_t> purged_buckets{};
+    // remote_queues has a RemoteQueue for every owner number. Owner number zero means no owner, so its queue goes unused.
+    RemoteQueue remote_queues[max_owners]{};
+    std::atomic<bool> remote_frees{ true };
+    std::atomic<uint64_t> peak_buckets{};
+    // fallback_free releases memory that didn't come from this heap, such as a block handed over by a C library that
+    // allocated it with malloc. It defaults to std::free.
+    void (*fallback_free)(void*){ std::free };
+
+private:
+    size_t bucket_index(const void* p) const
+    {
+        return (static_cast<const std::byte*>(p) - reinterpret_cast<const std::byte*>(buckets)) / sizeof(Bucket);
+    }
+
+    // allocate_large maps a page-aligned region big enough for bytes plus a LargeHeader, and returns the address just
+    // past the header. With the usual alignment, that is sixteen bytes into the region. A stricter alignment needs a
+    // bigger region to find an aligned address in; the pages in front of the header's page, and those past the end of
+    // the allocation, are unmapped again right away.
+    void* allocate_large(size_t bytes, size_t alignment)
+    {
+        const auto slack = alignment > sizeof(LargeHeader) ? alignment : 0;
+        const auto region_bytes = round_up(bytes + sizeof(LargeHeader) + slack, page_size);
+        const auto region = bytes > SIZE_MAX - page_size - sizeof(LargeHeader) - slack
+                                    || real_time.load(std::memory_order_relaxed)
+                            ? MAP_FAILED
+                            : mmap(nullptr, region_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED)
+        {
+            failed_allocations.fetch_add(1, std::memory_order_relaxed);
+            throw std::bad_alloc{};
+        }
+        const auto first = reinterpret_cast<uintptr_t>(region);
+        const auto result = round_up(first + sizeof(LargeHeader), alignment < sizeof(LargeHeader) ? 1 : alignment);
+        const auto begin = (result - sizeof(LargeHeader)) / page_size * page_size;
+        const auto end = round_up(result + bytes, page_size);
+        if (begin > first) munmap(region, begin - first);
+        if (first + region_bytes > end) munmap(reinterpret_cast<void*>(end), first + region_bytes - end);
+        const auto header = new(reinterpret_cast<void*>(result - sizeof(LargeHeader))) LargeHeader{ end - begin, 0 };
+        header->check = large_check(header + 1);
+        return header + 1;
+    }
+
+    // free_outside frees p, which doesn't point into buckets. If it came from allocate_large, it is unmapped, and
+    // otherwise it goes to fallback_free. A large allocation with the usual alignment always starts exactly
+    // sizeof(LargeHeader) bytes into a page, so only a pointer with that offset gets its header read. Callers that know
+    // p came from this heap with a stricter alignment, and may sit anywhere in a page, pass true for from_heap.
+    void free_outside(void* p, bool from_heap)
+    {
+        if (!p) return;
+        const auto offset = reinterpret_cast<uintptr_t>(p) % page_size;
+        const auto header = static_cast<LargeHeader*>(p) - 1;
+        if ((from_heap || offset == sizeof(LargeHeader)) && header->check == large_check(p))
+        {
+            header->check = 0;
+            munmap(reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(header) / page_size * page_size),
+                   header->mapped_bytes);
+            shared_stats.count_free();
+            return;
+        }
+        fallback_free(p);
+    }
+
+    static uintptr_t round_up(uintptr_t n, uintptr_t multiple)
+    {
+        return (n + multiple - 1) / multiple * multiple;
+    }
+
+    static size_t large_check(const void* p)
+    {
+        return reinterpret_cast<uintptr_t>(p) ^ 0x4C617267654F626AULL;
+    }
+
+    static const size_t page_size{ 4096 };
+    static_assert(default_alignment <= sizeof(LargeHeader), "The LargeHeader keeps large allocations aligned.");
+
+    // take_bucket pops the most recently freed Bucket off the stack of free Buckets. If the stack is empty, it hands out
+    // the next never-used Bucket, in order. It returns nullptr when the heap is out of Buckets. The stack may only look
+    // empty because a purge has taken it, so if a purge was running at any point around the pop, take_bucket waits for
+    // it to finish and pops again.
+    Bucket* take_bucket(size_t c)
+    {
+        size_t i{};
+        for (;;)
+        {
+            const auto generation = purge_generation.load(std::memory_order_acquire);
+            if (pop_free(i)) break;
+            const auto generation_after = purge_generation.load(std::memory_order_acquire);
+            if (generation_after == generation && generation % 2 == 0)
+            {
+                std::lock_guard<std::mutex> lock{ pool_lock };
+                if (n_fresh >= max_buckets || (n_fresh == n_mapped && !grow())) return nullptr;
+                i = n_fresh++;
+                break;
+            }
+            if (generation_after % 2) std::lock_guard<std::mutex> wait{ purge_lock };
+        }
+        bucket_used[i / 64].fetch_or(uint64_t{ 1 } << (i % 64), std::memory_order_release);
+        const auto live = live_buckets.fetch_add(1, std::memory_order_relaxed) + 1;
+        auto peak = peak_buckets.load(std::memory_order_relaxed);
+        while (live > peak && !peak_buckets.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+        auto& info = bucket_info[i];
+        info.size_class = c;
+        info.live = 0;
+        info.n_fresh.store(0, std::memory_order_relaxed);
+        info.free_slots = nullptr;
+        info.prev = info.next = 0;
+        info.freed_at = 0;
+        return &buckets[i];
+    }
+
+    // free_remote gives every slot in a list taken from a RemoteQueue back to the heap.
+    void free_remote(RemoteSlot* slot)
+    {
+        while (slot)
+        {
+            const auto next = slot->next;
+            void* p{ slot };
+            free_batch(slot->size_class, &p, 1);
+            slot = next;
+        }
+    }
+
+    // release_bucket pushes the Bucket with index i onto the stack of free Buckets, and notes when, for purge.
+    void release_bucket(size_t i)
+    {
+        bucket_used[i / 64].fetch_and(~(uint64_t{ 1 } << (i % 64)), std::memory_order_release);
+        live_buckets.fetch_sub(1, std::memory_order_relaxed);
+        bucket_info[i].freed_at = now_ns();
+        push_free(i + 1, i + 1);
+    }
+
+    static uint64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // pop_free and push_free are the two ends of the compare-and-swap loop on free_top. A pop reads the link below the
+    // top Bucket and swings free_top down to it; a push links the Bucket to the current top and swings free_top up to
+    // it. Every successful swap also bumps the count in the high 32 bits.
+    bool pop_free(size_t& i)
+    {
+        std::unique_lock<std::mutex> lock{ pool_lock, std::defer_lock };
+        if (pool_mode.load(std::memory_order_relaxed) == PoolMode::mutex) lock.lock();
+        auto top = free_top.load(std::memory_order_acquire);
+        while (top & index_mask)
+        {
+            const auto index = (top & index_mask) - 1;
+            const uint64_t below = bucket_next[index].load(std::memory_order_relaxed);
+            if (free_top.compare_exchange_weak(top, next_count(top) | below, std::memory_order_acquire))
+            {
+                i = index;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // push_free pushes a whole chain of Buckets, already linked together through bucket_next, from the one with index
+    // plus one first down to the one with index plus one last. A single Bucket is a chain of one.
+    void push_free(size_t first, size_t last)
+    {
+        std::unique_lock<std::mutex> lock{ pool_lock, std::defer_lock };
+        if (pool_mode.load(std::memory_order_relaxed) == PoolMode::mutex) lock.lock();
+        auto top = free_top.load(std::memory_order_relaxed);
+        do
+        {
+            bucket_next[last - 1].store(static_cast<uint32_t>(top & index_mask), std::memory_order_relaxed);
+        }
+        while (!free_top.compare_exchange_weak(top, next_count(top) | first, std::memory_order_release,
+                                               std::memory_order_relaxed));
+    }
+
+    // take_free empties the stack of free Buckets in one swap, and returns the index plus one of its top Bucket, from
+    // which the rest are still linked through bucket_next. The swap also publishes the start of the purge that calls
+    // it, so a thread whose pop finds the stack empty sees that a purge is running.
+    size_t take_free()
+    {
+        std::unique_lock<std::mutex> lock{ pool_lock, std::defer_lock };
+        if (pool_mode.load(std::memory_order_relaxed) == PoolMode::mutex) lock.lock();
+        auto top = free_top.load(std::memory_order_acquire);
+        while ((top & index_mask) && !free_top.compare_exchange_weak(top, next_count(top), std::memory_order_acq_rel)) {}
+        return top & index_mask;
+    }
+
+    // last_free follows a chain of free Buckets taken by take_free down to its bottom Bucket.
+    size_t last_free(size_t first) const
+    {
+        auto last = first;
+        while (const auto next = bucket_next[last - 1].load(std::memory_order_relaxed)) last = next;
+        return last;
+    }
+
+    // purge_marked purges every run of Buckets marked in purge_marks, and clears the marks again. With huge pages, each
+    // run is trimmed to the whole huge pages inside it.
+    size_t purge_marked()
+    {
+        const auto n_words = n_mapped.load(std::memory_order_acquire) / 64;
+        const auto granule = huge_page_chunks.load(std::memory_order_relaxed) ? huge_page_size / sizeof(Bucket) : 1;
+        const auto advice = purge_mode.load(std::memory_order_relaxed) == PurgeMode::dont_need ? MADV_DONTNEED : MADV_FREE;
+        size_t n_purged{};
+        for (auto begin = find_mark(0, true, n_words); begin < n_words * 64;)
+        {
+            const auto end = find_mark(begin, false, n_words);
+            const auto first = round_up(begin, granule), last = end / granule * granule;
+            if (first < last && madvise(buckets + first, (last - first) * sizeof(Bucket), advice) == 0)
+            {
+                for (auto i = first; i < last; i++) bucket_info[i].freed_at = purged;
+                n_purged += last - first;
+            }
+            begin = find_mark(end, true, n_words);
+        }
+        std::fill(purge_marks, purge_marks + n_words, 0);
+        return n_purged;
+    }
+
+    // find_mark finds the first Bucket from index from on whose mark is set, or isn't. It searches purge_marks the same
+    // way find_free searches bucket_used, skipping the words with no bit it wants, zero or all ones, with skip_words.
+    size_t find_mark(size_t from, bool set, size_t n_words) const
+    {
+        auto w = from / 64;
+        if (w >= n_words) return n_words * 64;
+        auto bits = (set ? purge_marks[w] : ~purge_marks[w]) & (~uint64_t{} << (from % 64));
+        while (!bits)
+        {
+            if (++w >= n_words) return n_words * 64;
+            w = skip_words(purge_marks, w, n_words, set ? 0 : ~uint64_t{});
+            if (w >= n_words) return n_words * 64;
+            bits = set ? purge_marks[w] : ~purge_marks[w];
+        }
+        return w * 64 + __builtin_ctzll(bits);
+    }
+
+    static uint64_t next_count(uint64_t top)
+    {
+        return (top + (uint64_t{ 1 } << 32)) & ~index_mask;
+    }
+
+    static const uint64_t index_mask{ 0xFFFFFFFF };
+
+    static unsigned long long ull(uint64_t n)
+    {
+        return n;
+    }
+
+    // skip_words returns the first word of the bitmap words at or after w that isn't equal to skipped: all ones to
+    // skip the words of bucket_used in which every Bucket is in use, or zero to skip the words of purge_marks with no
+    // marks. With AVX2 it compares four words at a time, with SSE2 two, and otherwise it checks one word at a time.
+    // The last few words are read with relaxed atomic loads, since bucket_used can change while it is searched.
+    static size_t skip_words(const uint64_t* words, size_t w, size_t n_words, uint64_t skipped)
+    {
+#if defined(__AVX2__)
+        const auto pattern = _mm256_set1_epi64x(static_cast<long long>(skipped));
+        while (w + 4 <= n_words)
+        {
+            const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + w));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern)) != -1) break;
+            w += 4;
+        }
+#elif defined(__SSE2__)
+        const auto pattern = _mm_set1_epi64x(static_cast<long long>(skipped));
+        while (w + 2 <= n_words)
+        {
+            const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + w));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern)) != 0xFFFF) break;
+            w += 2;
+        }
+#endif
+        while (w < n_words && __atomic_load_n(words + w, __ATOMIC_RELAXED) == skipped) w++;
+        return w;
+    }
+
+    // grow maps the next chunk of Buckets, along with the bookkeeping that goes with them, reserving the whole range
+    // first if this is the heap's first allocation. Every mapping is MAP_FIXED inside the reserved range, so existing
+    // Buckets stay exactly where they are. It returns false if the system is out of memory.
+    bool grow()
+    {
+        if (!buckets && !reserve()) return false;
+        const auto first = n_mapped.load(std::memory_order_relaxed);
+        if (!map_buckets(buckets + first, chunk_buckets * sizeof(Bucket))
+            || !map(bucket_info + first, chunk_buckets * sizeof(BucketInfo))
+            || !map(bucket_next + first, chunk_buckets * sizeof(uint32_t))
+            || !map(bucket_owner + first, chunk_buckets * sizeof(uint16_t)))
+        {
+            return false;
+        }
+        n_mapped.store(first + chunk_buckets, std::memory_order_release);
+        return true;
+    }
+
+    // reserve takes a range of addresses big enough for every Bucket and its bookkeeping, without committing any
+    // memory to it: the pages are inaccessible until grow maps them. Only the bitmaps are mapped right away.
+    bool reserve()
+    {
+        // reserve runs under pool_lock, so it sets max_buckets itself rather than through set_max_buckets.
+        if (const auto cap = std::getenv("HEAP_MAX_BUCKETS"))
+        {
+            const size_t n = std::strtoull(cap, nullptr, 10);
+            max_buckets = n < max_reserved_buckets ? n : max_reserved_buckets;
+        }
+        if (const auto huge = std::getenv("HEAP_HUGE_PAGES"); huge && std::strcmp(huge, "0") != 0)
+        {
+            page_mode = PageMode::huge;
+        }
+        if (const auto decay = std::getenv("HEAP_PURGE_DECAY_MS"))
+        {
+            set_purge_decay(std::chrono::milliseconds{ std::strtoull(decay, nullptr, 10) });
+        }
+        const auto bitmap_bytes = max_reserved_buckets / 8;
+        const auto bytes = max_reserved_buckets * (sizeof(Bucket) + sizeof(BucketInfo) + sizeof(uint32_t)
+                                                   + sizeof(uint16_t)) + 2 * bitmap_bytes;
+        // The range is reserved one huge page larger than it needs to be, so the Buckets can start on a huge page
+        // boundary.
+        const auto reserved = mmap(nullptr, bytes + huge_page_size, PROT_NONE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED) return false;
+        buckets = reinterpret_cast<Bucket*>(round_up(reinterpret_cast<uintptr_t>(reserved), huge_page_size));
+        bucket_info = reinterpret_cast<BucketInfo*>(buckets + max_reserved_buckets);
+        bucket_next = reinterpret_cast<std::atomic<uint32_t>*>(bucket_info + max_reserved_buckets);
+        bucket_owner = reinterpret_cast<std::atomic<uint16_t>*>(bucket_next + max_reserved_buckets);
+        bucket_used = reinterpret_cast<std::atomic<uint64_t>*>(bucket_owner + max_reserved_buckets);
+        purge_marks = reinterpret_cast<uint64_t*>(bucket_used + max_reserved_buckets / 64);
+        if (!map(bucket_used, 2 * bitmap_bytes)) return false;
+        range.store(reinterpret_cast<std::byte*>(buckets), std::memory_order_release);
+        return true;
+    }
+
+    static bool map(void* address, size_t bytes)
+    {
+        return mmap(address, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED;
+    }
+
+    // map_buckets maps a chunk of Buckets in the current page mode. Huge pages are mapped somewhere else first and then
+    // moved into place with mremap, which replaces the reserved pages in one step. Mapping them straight into place
+    // with MAP_FIXED could leave a hole in the range if the kernel ran out of huge pages halfway through.
+    bool map_buckets(void* address, size_t bytes)
+    {
+        if (page_mode == PageMode::normal) return map(address, bytes);
+#if defined(MAP_HUGETLB) && defined(MREMAP_FIXED)
+        const auto huge = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (huge != MAP_FAILED)
+        {
+            if (mremap(huge, bytes, bytes, MREMAP_MAYMOVE | MREMAP_FIXED, address) != MAP_FAILED)
+            {
+                huge_page_chunks.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            munmap(huge, bytes);
+        }
+#endif
+        if (!map(address, bytes)) return false;
+#ifdef MADV_HUGEPAGE
+        if (madvise(address, bytes, MADV_HUGEPAGE) == 0)
+        {
+            huge_page_chunks.fetch_add(1, std::memory_order_relaxed);
+            transparent_huge_page_chunks.fetch_add(1, std::memory_order_relaxed);
+        }
+#endif
+        return true;
+    }
+
+    // push_partial and remove_partial link and unlink the Bucket with index plus one i into its size class's chain of
+    // Buckets with free slots. The caller holds the size class's class_lock.
+    void push_partial(size_t i)
+    {
+        auto& info = bucket_info[i - 1];
+        auto& head = partial[info.size_class];
+        info.prev = 0;
+        info.next = head;
+        if (head) bucket_info[head - 1].prev = i;
+        head = i;
+    }
+
+    void remove_partial(size_t i)
+    {
+        auto& info = bucket_info[i - 1];
+        if (info.prev) bucket_info[info.prev - 1].next = info.next;
+        else partial[info.size_class] = info.next;
+        if (info.next) bucket_info[info.next - 1].prev = info.prev;
+        info.prev = info.next = 0;
+    }
+};
+
+// ThreadCache keeps a small stack of free slots of every size class for a single thread, in front of a Heap. Allocating
+// pops a slot off the stack and freeing pushes one on, so the common path takes no lock at all. Only when a stack runs
+// empty does the cache refill it with a whole batch from the Heap, and only when a stack runs full does it flush a batch
+// back, so the Heap's locks are taken once per batch rather than once per allocation.
+struct ThreadCache
+{
+    constexpr explicit ThreadCache(Heap& heap) : heap{ &heap } {}
+
+    // allocate, free and free_aligned mirror the Heap's. Allocations and frees that the cache can't serve, like large
+    // ones, go straight to the Heap.
+    void* allocate(size_t bytes, size_t alignment = Heap::default_alignment)
+    {
+        const auto rounded = bytes < alignment ? alignment : bytes;
+        if (rounded > Bucket::data_size || retired) return heap->allocate(bytes, alignment);
+        const auto c = Heap::size_class(rounded);
+        auto& bin = bins[c];
+        if (bin.count == 0) refill(c);
+        stats.count_allocation(c, bytes);
+        return bin.slots[--bin.count];
+    }
+
+    void free(void* p)
+    {
+        if (retired || !heap->owns(p))
+        {
+            heap->free(p);
+            return;
+        }
+        const auto c = heap->slot_class(p);
+        if (c == Heap::n_size_classes) return;
+        free_slot(c, p);
+    }
+
+    // The size, and alignment, of a sized deallocation give away the size class, so p goes into its stack without being
+    // looked up. Pointers from outside the heap are passed on to it, as in the unsized free.
+    void free(void* p, size_t bytes, size_t alignment = Heap::default_alignment)
+    {
+        const auto rounded = bytes < alignment ? alignment : bytes;
+        if (rounded > Bucket::data_size || retired || !heap->owns(p))
+        {
+            heap->free(p, bytes, alignment);
+            return;
+        }
+        free_slot(Heap::size_class(rounded), p);
+    }
+
+    void free_aligned(void* p)
+    {
+        if (retired || !heap->owns(p)) heap->free_aligned(p);
+        else free(p);
+    }
+
+    // retire flushes every slot back to the heap when the cache's thread exits, and hands its counts over to the heap.
+    // Anything the thread allocates or frees after that, from the destructors of other thread-local objects for
+    // instance, goes straight to the heap.
+    void retire()
+    {
+        for (size_t c{}; c < Heap::n_size_classes; c++) flush(c, bins[c].count);
+        heap->release_owner(owner);
+        heap->detach(stats);
+        retired = true;
+    }
+
+    // prepare readies the cache for a real-time thread (see Heap::set_real_time). It registers the thread, fills every
+    // bin, and locks the cache into memory, so the thread's first allocations don't take locks or fault in pages. It
+    // returns false if the cache couldn't be locked.
+    bool prepare()
+    {
+        if (!registered) register_thread();
+        for (size_t c{}; c < Heap::n_size_classes; c++)
+        {
+            if (!bins[c].count) refill(c);
+        }
+        return Heap::lock_pages(this, sizeof(*this));
+    }
+
+    // Whole Buckets are big, so the cache holds fewer of them.
+    static size_t batch_size(size_t c)
+    {
+        return c == Heap::whole_bucket_class ? 4 : 32;
+    }
+    static const size_t capacity{ 64 };
+
+private:
+    struct Bin
+    {
+        void* slots[capacity];
+        size_t count;
+    };
+
+    // free_slot sends p to the thread that owns its Bucket, if that is another thread, and keeps it otherwise.
+    void free_slot(size_t c, void* p)
+    {
+        if (!registered) register_thread();
+        const auto p_owner = heap->owner_of(p);
+        if (p_owner && p_owner != owner)
+        {
+            heap->push_remote(p_owner, p, c);
+            stats.count_remote_free();
+            return;
+        }
+        push(c, p);
+        stats.count_free();
+    }
+
+    void push(size_t c, void* p)
+    {
+        auto& bin = bins[c];
+        if (bin.count == capacity) flush(c, batch_size(c));
+        bin.slots[bin.count++] = p;
+    }
+
+    // refill first reclaims the slots other threads have freed to this thread, and only takes a batch from the heap if
+    // none of them are of size class c. The heap hands slots out in address order, so the batch is reversed to pop them
+    // off the stack in that same order.
+    void refill(size_t c)
+    {
+        if (!registered) register_thread();
+        for (auto slot = heap->take_remote(owner); slot;)
+        {
+            const auto next = slot->next;
+            push(slot->size_class, slot);
+            slot = next;
+        }
+        auto& bin = bins[c];
+        if (bin.count) return;
+        bin.count = heap->allocate_batch(c, bin.slots, batch_size(c), owner);
+        std::reverse(bin.slots, bin.slots + bin.count);
+    }
+
+    // flush gives the n slots at the bottom of the stack, which were freed longest ago, back to the heap.
+    void flush(size_t c, size_t n)
+    {
+        auto& bin = bins[c];
+        heap->free_batch(c, bin.slots, n);
+        std::memmove(bin.slots, bin.slots + n, (bin.count - n) * sizeof(void*));
+        bin.count -= n;
+    }
+
+    // ThreadCache itself is trivially destructible, so it stays usable for as long as its thread runs. Instead, the
+    // first time each thread uses its cache, it attaches the cache's Stats to the heap and links the cache into the
+    // thread's Retirer, whose destructor retires every cache in its list at thread exit. There is one Retirer per
+    // thread but a thread may use several caches, one for each Heap, so the caches are chained through
+    // next_registered.
+    void register_thread()
+    {
+        registered = true;
+        heap->attach(stats);
+        owner = heap->claim_owner();
+        struct Retirer
+        {
+            ThreadCache* caches;
+            ~Retirer()
+            {
+                for (auto cache = caches; cache; cache = cache->next_registered) cache->retire();
+            }
+        };
+        static thread_local Retirer retirer{};
+        next_registered = retirer.caches;
+        retirer.caches = this;
+    }
+
+    Heap* heap;
+    ThreadCache* next_registered{};
+    bool registered{};
+    bool retired{};
+    uint16_t owner{};
+    Bin bins[Heap::n_size_classes]{};
+    Heap::Stats stats{};
+};
+
+// Arena is for objects that all share one lifetime, like everything allocated while handling a single request. Rather
+// than freeing them one by one, the whole Arena is released at once with reset. It takes whole Buckets from a Heap as
+// chunks and hands out memory by bumping a pointer through the current chunk, so allocating is little more than an
+// addition and a comparison, and there is no per-object bookkeeping at all. When a chunk runs out, the rest of it is
+// simply abandoned until reset. Requests too big for a chunk get a chunk of their own. This is the same idea as
+// std::pmr::monotonic_buffer_resource.
+// Objects made with create have their destructors run by reset, newest first, as if they went out of scope. Only
+// types that aren't trivially destructible need that: create registers a Finalizer for them, which lives in the arena
+// too. An Arena belongs to a single thread.
+struct Arena
+{
+    explicit Arena(Heap& heap) : heap{ &heap } {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena()
+    {
+        reset();
+    }
+
+    // allocate returns bytes of memory aligned to alignment, which must be a power of two.
+    void* allocate(size_t bytes, size_t alignment = Heap::default_alignment)
+    {
+        const auto start = align_up(next, alignment);
+        if (next && start <= end && bytes <= end - start)
+        {
+            next = start + bytes;
+            return reinterpret_cast<void*>(start);
+        }
+        return allocate_chunk(bytes, alignment);
+    }
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        if constexpr (std::is_trivially_destructible_v<T>)
+        {
+            return new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+        else
+        {
+            // The Finalizer is allocated first, so nothing can fail between constructing the object and registering
+            // it. If the constructor throws, the Finalizer's memory is just left unused until reset.
+            const auto finalizer = allocate(sizeof(Finalizer), alignof(Finalizer));
+            const auto object = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            finalizers = new(finalizer) Finalizer{ [](void* p) { static_cast<T*>(p)->~T(); }, object, finalizers };
+            return object;
+        }
+    }
+
+    // reset runs the destructors registered by create and gives every chunk back to the heap. Everything the arena
+    // handed out is gone afterwards, and the arena can be used again.
+    void reset()
+    {
+        for (; finalizers; finalizers = finalizers->next) finalizers->destroy(finalizers->object);
+        while (chunks)
+        {
+            const auto chunk = chunks;
+            chunks = chunk->previous;
+            heap->free(chunk, chunk->bytes);
+        }
+        next = end = 0;
+    }
+
+private:
+    // Every chunk starts with a Chunk, which links it to the chunk before it and remembers its size, so reset can free
+    // it without the heap looking it up.
+    struct alignas(Heap::default_alignment) Chunk
+    {
+        Chunk* previous;
+        size_t bytes;
+    };
+
+    struct Finalizer
+    {
+        void (*destroy)(void*);
+        void* object;
+        Finalizer* next;
+    };
+
+    static uintptr_t align_up(uintptr_t address, size_t alignment)
+    {
+        return (address + alignment - 1) & ~(alignment - 1);
+    }
+
+    // allocate_chunk takes a new chunk from the heap when the current one can't fit bytes. A request that wouldn't fit
+    // in an empty Bucket gets a chunk of exactly its own size, which is linked in behind the current chunk so the arena
+    // keeps bumping through that.
+    void* allocate_chunk(size_t bytes, size_t alignment)
+    {
+        if (bytes > SIZE_MAX - sizeof(Chunk) - alignment) throw std::bad_alloc{};
+        const auto own_chunk = sizeof(Chunk) + bytes + alignment > Bucket::data_size;
+        const auto chunk_bytes = own_chunk ? sizeof(Chunk) + bytes + alignment : Bucket::data_size;
+        const auto chunk = new(heap->allocate(chunk_bytes)) Chunk{ nullptr, chunk_bytes };
+        const auto start = align_up(reinterpret_cast<uintptr_t>(chunk + 1), alignment);
+        if (own_chunk && chunks)
+        {
+            chunk->previous = chunks->previous;
+            chunks->previous = chunk;
+            return reinterpret_cast<void*>(start);
+        }
+        chunk->previous = chunks;
+        chunks = chunk;
+        next = start + bytes;
+        end = reinterpret_cast<uintptr_t>(chunk) + chunk_bytes;
+        return reinterpret_cast<void*>(start);
+    }
+
+    Heap* heap;
+    Chunk* chunks{};
+    Finalizer* finalizers{};
+    uintptr_t next{};
+    uintptr_t end{};
+};
+
+// HeapResource is a std::pmr::memory_resource that draws its memory from a Heap, so std::pmr containers can use a Heap
+// without operator new being replaced. A part of a program can be given a Heap of its own this way, one container at a
+// time. A memory_resource always passes the size and alignment along when it deallocates, so every deallocation takes
+// Heap's sized free and p is never looked up. Like the Heap, a HeapResource is safe to share between threads, but it
+// takes the Heap's locks on every call: there is no ThreadCache in front of it.
+struct HeapResource : std::pmr::memory_resource
+{
+    explicit HeapResource(Heap& heap) : heap{ &heap } {}
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        return heap->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override
+    {
+        heap->free(p, bytes, alignment);
+    }
+
+    // Two HeapResources are equal if they share a Heap, because then either can free what the other allocated.
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        const auto resource = dynamic_cast<const HeapResource*>(&other);
+        return resource && resource->heap == heap;
+    }
+
+    Heap* heap;
+};
+
+// FaultCounter checks that a stretch of code, like the hot path of a real-time thread, didn't have to wait for the
+// kernel. It reads the calling thread's resource usage with getrusage when it's created and again when counts is called,
+// and reports the difference. A minor fault is a page the kernel had to map in, such as a fresh page touched for the
+// first time, and a major fault one it had to read from disk. getrusage can't count system calls, but a call that
+// blocks, like a futex wait on a contended lock, gives up the processor and shows up as a voluntary context switch.
+// Involuntary switches, where the scheduler simply ran another thread, aren't the code's doing and aren't counted.
+// getrusage is a system call itself, so it belongs around the hot path, not in it.
+struct FaultCounter
+{
+    struct Counts
+    {
+        long minor_faults;
+        long major_faults;
+        long voluntary_switches;
+
+        bool none() const
+        {
+            return minor_faults == 0 && major_faults == 0 && voluntary_switches == 0;
+        }
+    };
+
+    FaultCounter() : start{ read() } {}
+
+    Counts counts() const
+    {
+        const auto now = read();
+        return Counts{ now.minor_faults - start.minor_faults, now.major_faults - start.major_faults,
+                       now.voluntary_switches - start.voluntary_switches };
+    }
+
+private:
+    static Counts read()
+    {
+        rusage usage{};
+        getrusage(RUSAGE_THREAD, &usage);
+        return Counts{ usage.ru_minflt, usage.ru_majflt, usage.ru_nvcsw };
+    }
+
+    Counts start;
+};
+
+#endif //CRASH_COURSE_HEAP_HPP
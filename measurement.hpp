@@ -0,0 +1,60 @@
+// measurement.hpp holds what the allocator benchmarks share for measuring: resident_kib and peak_growth_mib read the
+// resident set of the process, and run_in_child runs a measurement in a child process of its own.
+// allocator_benchmark.cpp, trace_replay.cpp and the purge demo in overloadedNewOperator.cpp use them.
+
+#ifndef CRASH_COURSE_MEASUREMENT_HPP
+#define CRASH_COURSE_MEASUREMENT_HPP
+
+#include <cstdio>
+#include <type_traits>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// resident_kib reads how much of this process is resident in memory right now.
+inline long resident_kib()
+{
+    long pages{}, resident{};
+    if (const auto statm = std::fopen("/proc/self/statm", "r"))
+    {
+        if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        std::fclose(statm);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// peak_growth_mib returns how far the resident set has grown beyond rss_before_kib at its peak so far, in MiB.
+inline double peak_growth_mib(long rss_before_kib)
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_maxrss - rss_before_kib) / 1024.0;
+}
+
+// run_in_child calls measure in a child process and passes the Result it returns back through a pipe. Every child
+// starts out with a fresh copy of this process, in which nothing measured so far has touched the allocators, and the
+// peak resident set of one measurement can't carry over into the next. The Result goes through the pipe as raw bytes,
+// so it must be trivially copyable.
+template <typename Result, typename Measure>
+bool run_in_child(Measure measure, Result& result)
+{
+    static_assert(std::is_trivially_copyable_v<Result>, "A Result goes through the pipe as raw bytes.");
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+    const auto child = fork();
+    if (child == 0)
+    {
+        close(fds[0]);
+        const Result measured = measure();
+        const auto written = write(fds[1], &measured, sizeof(measured));
+        _exit(written == sizeof(measured) ? 0 : 1);
+    }
+    close(fds[1]);
+    const auto received = child > 0 ? read(fds[0], &result, sizeof(result)) : 0;
+    close(fds[0]);
+    int status{};
+    if (child > 0) waitpid(child, &status, 0);
+    return received == sizeof(result);
+}
+
+#endif //CRASH_COURSE_MEASUREMENT_HPP
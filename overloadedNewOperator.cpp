@@ -16,6 +16,7 @@
  * void* operator new[](size_t)
  * void operator delete[](void*)
  */
+// along with sized and aligned variants of them, which take an extra size_t or std::align_val_t argument.
 
 // The return type of operator new is void*. The free store operators deal in raw, uninitialized memory.
 // It is possible to provide your own versions of these four operators.
@@ -33,102 +34,534 @@
 // to bucket size. Modern OS, such as Windows, will have fairly complex schemes for allocating memory of different sizes.
 // You don't see this complexity unless you want to take control.
 
-// The following program implements a simple Bucket and Heap class.
+// The following program implements a simple Bucket and Heap class. They live in heap.hpp, so other programs can share
+// them; this program replaces operator new and operator delete with them.
 
+#include "heap.hpp"
+#include "allocation_trace.hpp"
+#include "measurement.hpp"
 #include <cstddef>
+#include <cstdint>
 #include <new>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <thread>
+#include <vector>
+#include <unistd.h>
 
-// Bucket class is responsible for taking up space in memory. As an homage to the Windows heap manager, the bucket
-// size is hardcoded to 4096. All of the management logic goes into the heap class.
-struct Bucket
+// The order in which Heap hands out Buckets is deterministic: never-used Buckets come out in index order, and freed
+// Buckets come back out in last-in, first-out order. check_bucket_order verifies this on a scratch Heap, so it doesn't
+// disturb the global heap used by operator new.
+bool check_bucket_order()
 {
-    const static size_t data_size{ 4096 };
-    std::byte data[data_size];
+    static Heap scratch;
+    const auto whole = Bucket::data_size;
+    void* first = scratch.allocate(whole);
+    void* second = scratch.allocate(whole);
+    void* third = scratch.allocate(whole);
+    if (first != scratch.buckets[0].data || second != scratch.buckets[1].data || third != scratch.buckets[2].data)
+    {
+        return false;
+    }
+    scratch.free(first);
+    scratch.free(third);
+    // The occupancy bitmap sees the gaps left by first and third.
+    if (scratch.find_free(0) != 0 || scratch.find_free(1) != 2) return false;
+    // third was freed last, so it comes back first; then first; then the never-used buckets[3].
+    return scratch.allocate(whole) == third && scratch.allocate(whole) == first
+           && scratch.allocate(whole) == scratch.buckets[3].data;
+}
+
+// report_size_class_savings allocates a workload of small objects on a scratch Heap and compares the memory it takes up
+// against the old design, in which every object took up a whole Bucket.
+void report_size_class_savings()
+{
+    static Heap scratch;
+    const size_t sizes[]{ sizeof(char), sizeof(unsigned int), sizeof(double), 24, 40, 100 };
+    const size_t n_objects{ 120 };
+    size_t requested{};
+    for (size_t i{}; i < n_objects; i++)
+    {
+        const auto bytes = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+        scratch.allocate(bytes);
+        requested += bytes;
+    }
+    const auto before = n_objects * sizeof(Bucket);
+    const auto after = scratch.in_use() * sizeof(Bucket);
+    printf("%zu small objects (%zu bytes requested):\n", n_objects, requested);
+    printf("  one Bucket per object: %zu bytes\n", before);
+    printf("  size classes:          %zu bytes (%.1f%% saved)\n", after, 100.0 * (before - after) / before);
+}
+
+// One way to allocate a Heap is to declare it at namespace scope so it has static storage duration.  Because its lifetime
+// begins when the program starts, you can use it inside the operator new and operator delete overrides.
+// Each thread gets its own ThreadCache in front of it.
+
+// Replacing only operator new(size_t) and operator delete(void*) isn't enough to route every allocation to the heap.
+// The array forms, new[] and delete[], are replaced too, so new int[100] lands in the heap no matter how the standard
+// library forwards them. Since C++14, delete passes the size of the object along to a sized operator delete when it
+// knows it, and the heap uses the size to skip looking the pointer up. Since C++17, types aligned more strictly than
+// alignof(std::max_align_t) are allocated with the std::align_val_t overloads.
+
+// Setting the HEAP_TRACE environment variable to a file name makes the overrides record every allocation and free to
+// that file, for trace_replay.cpp to replay. Allocations are recorded after they are made and frees before, so that
+// when another thread gets the same address right after a free, the free still comes first in the trace.
+
+Heap heap;
+thread_local ThreadCache thread_cache{ heap };
+TraceRecorder trace_recorder;
+
+void* traced_allocation(void* p, size_t n_bytes, size_t alignment)
+{
+    trace_recorder.record(TraceEvent::allocation, p, n_bytes, alignment);
+    return p;
+}
+
+void trace_free(void* p, size_t n_bytes, size_t alignment)
+{
+    if (p) trace_recorder.record(TraceEvent::free, p, n_bytes, alignment);
+}
+
+void* operator new(size_t n_bytes)
+{
+    return traced_allocation(thread_cache.allocate(n_bytes), n_bytes, 0);
+}
+
+void* operator new[](size_t n_bytes)
+{
+    return traced_allocation(thread_cache.allocate(n_bytes), n_bytes, 0);
+}
+
+void* operator new(size_t n_bytes, std::align_val_t alignment)
+{
+    const auto a = static_cast<size_t>(alignment);
+    return traced_allocation(thread_cache.allocate(n_bytes, a), n_bytes, a);
+}
+
+void* operator new[](size_t n_bytes, std::align_val_t alignment)
+{
+    const auto a = static_cast<size_t>(alignment);
+    return traced_allocation(thread_cache.allocate(n_bytes, a), n_bytes, a);
+}
+
+void operator delete(void* p) noexcept
+{
+    trace_free(p, 0, 0);
+    return thread_cache.free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    trace_free(p, 0, 0);
+    return thread_cache.free(p);
+}
+
+void operator delete(void* p, size_t n_bytes) noexcept
+{
+    trace_free(p, n_bytes, 0);
+    return thread_cache.free(p, n_bytes);
+}
+
+void operator delete[](void* p, size_t n_bytes) noexcept
+{
+    trace_free(p, n_bytes, 0);
+    return thread_cache.free(p, n_bytes);
+}
+
+void operator delete(void* p, std::align_val_t alignment) noexcept
+{
+    trace_free(p, 0, static_cast<size_t>(alignment));
+    return thread_cache.free_aligned(p);
+}
+
+void operator delete[](void* p, std::align_val_t alignment) noexcept
+{
+    trace_free(p, 0, static_cast<size_t>(alignment));
+    return thread_cache.free_aligned(p);
+}
+
+void operator delete(void* p, size_t n_bytes, std::align_val_t alignment) noexcept
+{
+    trace_free(p, n_bytes, static_cast<size_t>(alignment));
+    return thread_cache.free(p, n_bytes, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void* p, size_t n_bytes, std::align_val_t alignment) noexcept
+{
+    trace_free(p, n_bytes, static_cast<size_t>(alignment));
+    return thread_cache.free(p, n_bytes, static_cast<size_t>(alignment));
+}
+
+// CacheLine and Page are aligned more strictly than usual, so new and delete use the std::align_val_t overloads for
+// them. A CacheLine fits in a 64-byte slot; a Page is too big for a Bucket and gets an aligned mapping of its own.
+struct alignas(64) CacheLine
+{
+    std::byte data[40];
 };
 
-struct Heap {
+struct alignas(8192) Page
+{
+    std::byte data[8192];
+};
 
-    // allocate first checks whether the number of bytes requested is greater than the bucket size. If it is, it throws
-    // a std::bad_alloc exception. Then, Heap iterates through the buckets looking for one that isn't marked true in
-    // bucket_used. If it finds one, it returns the data member pointer for the associated Bucket.
-    void* allocate(size_t bytes)
+// A Guest only lives as long as the Arena it was created in. Its destructor counts how many have left.
+struct Guest
+{
+    explicit Guest(size_t seat) : seat{ seat } {}
+    ~Guest()
     {
-        if (bytes > Bucket::data_size) throw std::bad_alloc{};
-        for (size_t i{}; i < n_heap_buckets; i++)
+        n_departed++;
+    }
+
+    size_t seat;
+    static inline size_t n_departed{};
+};
+
+// stress_test hammers operator new and operator delete from n_threads threads at once. Every object records its size
+// in its first bytes and fills the rest with a pattern derived from it, which is checked before the object is deleted,
+// so two threads ever being handed the same memory shows up as a corrupted pattern. Every thread also passes some of its
+// objects through a mailbox to the next thread, which deletes them.
+bool stress_test(size_t n_threads, size_t n_operations)
+{
+    std::vector<std::atomic<size_t*>> mailboxes(n_threads);
+    std::atomic<bool> corrupted{};
+    const auto fill = [](size_t* object, size_t bytes)
+    {
+        object[0] = bytes;
+        std::memset(object + 1, static_cast<int>(bytes & 0xFF), bytes - sizeof(size_t));
+    };
+    const auto check_and_delete = [&corrupted](size_t* object)
+    {
+        const auto bytes = object[0];
+        const auto pattern = reinterpret_cast<unsigned char*>(object + 1);
+        for (size_t i{}; i < bytes - sizeof(size_t); i++)
+        {
+            if (pattern[i] != (bytes & 0xFF)) corrupted = true;
+        }
+        operator delete(object);
+    };
+    std::vector<std::thread> threads;
+    for (size_t t{}; t < n_threads; t++)
+    {
+        threads.emplace_back([&, t]
         {
-            if (!bucket_used[i])
+            std::vector<size_t*> live;
+            uint64_t state{ 0x9E3779B97F4A7C15ULL * (t + 1) };
+            const auto next_random = [&state]
+            {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                return state;
+            };
+            for (size_t i{}; i < n_operations; i++)
             {
-                bucket_used[i] = true;
-                return buckets[i].data;
+                if (live.size() < 256 && next_random() % 2)
+                {
+                    // Mostly small objects, with the odd whole Bucket or large allocation.
+                    const auto r = next_random();
+                    const size_t bytes = sizeof(size_t) + (r % 64 == 0 ? r % 20'000 : r % 64 == 1 ? 4'000 : r % 500);
+                    const auto object = static_cast<size_t*>(operator new(bytes));
+                    fill(object, bytes);
+                    live.push_back(object);
+                }
+                else if (!live.empty())
+                {
+                    const auto k = next_random() % live.size();
+                    auto object = live[k];
+                    live[k] = live.back();
+                    live.pop_back();
+                    if (next_random() % 4 == 0) object = mailboxes[(t + 1) % n_threads].exchange(object);
+                    if (object) check_and_delete(object);
+                }
+                if (const auto mail = mailboxes[t].exchange(nullptr)) check_and_delete(mail);
             }
+            for (const auto object : live) check_and_delete(object);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    for (auto& mailbox : mailboxes)
+    {
+        if (const auto mail = mailbox.exchange(nullptr)) check_and_delete(mail);
+    }
+    return !corrupted;
+}
+
+// scaling_benchmark times operator new and operator delete on 1 to max_threads threads at once. Each thread allocates a
+// burst of small objects and then deletes them all, over and over. The thread caches keep the common path free of
+// locks, so the total throughput should grow with the number of threads.
+void scaling_benchmark(size_t max_threads)
+{
+    const size_t n_rounds{ 20'000 }, burst{ 64 };
+    printf("threads  Mops/s  Mops/s per thread\n");
+    for (size_t n_threads{ 1 }; n_threads <= max_threads; n_threads++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t t{}; t < n_threads; t++)
+        {
+            threads.emplace_back([]
+            {
+                void* objects[burst];
+                for (size_t round{}; round < n_rounds; round++)
+                {
+                    for (size_t k{}; k < burst; k++)
+                    {
+                        objects[k] = operator new(16 + (k * 24) % 500);
+                        *static_cast<char*>(objects[k]) = 1;
+                    }
+                    for (size_t k{}; k < burst; k++) operator delete(objects[k]);
+                }
+            });
         }
-        throw std::bad_alloc{};
+        for (auto& thread : threads) thread.join();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        const auto mops = 2.0 * n_rounds * burst * n_threads / elapsed.count() / 1e6;
+        printf("%7zu  %6.1f  %17.1f\n", n_threads, mops, mops / n_threads);
     }
+}
 
-    void free(void* p)
+// contention_benchmark measures how fast 1 to max_threads threads can take whole Buckets from the shared pool and give
+// them back, in each PoolMode. It uses the Heap directly rather than operator new, so no ThreadCache soaks up the
+// contention.
+void contention_benchmark(size_t max_threads)
+{
+    static Heap scratch;
+    const size_t n_rounds{ 100'000 }, burst{ 4 };
+    const std::pair<Heap::PoolMode, const char*> modes[]{ { Heap::PoolMode::mutex, "mutex" },
+                                                          { Heap::PoolMode::lock_free, "lock-free" } };
+    printf("threads  mutex Mops/s  lock-free Mops/s\n");
+    for (size_t n_threads{ 1 }; n_threads <= max_threads; n_threads++)
     {
-        for (size_t i{}; i < n_heap_buckets; i++)
+        printf("%7zu", n_threads);
+        for (const auto& mode : modes)
         {
-            if (buckets[i].data == p)
+            scratch.set_pool_mode(mode.first);
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for (size_t t{}; t < n_threads; t++)
             {
-                bucket_used[i] = false;
-                return;
+                threads.emplace_back([]
+                {
+                    void* buckets[burst];
+                    for (size_t round{}; round < n_rounds; round++)
+                    {
+                        for (auto& bucket : buckets) bucket = scratch.allocate(Bucket::data_size);
+                        for (auto bucket : buckets) scratch.free(bucket);
+                    }
+                });
             }
+            for (auto& thread : threads) thread.join();
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            printf("  %*.1f", mode.first == Heap::PoolMode::mutex ? 12 : 16,
+                   2.0 * n_rounds * burst * n_threads / elapsed.count() / 1e6);
         }
+        printf("\n");
     }
+}
 
-    static const size_t n_heap_buckets{ 10 };
-    // The buckets member houses all the Buckets, neatly packed into a contiguous string.
-    Bucket buckets[n_heap_buckets]{};
-    // bucket_used member is a relatively tiny array containing objects of type bool that keeps track of whether a
-    // Bucket in buckets with the same index has been loaned out yet. Both members are initialized to zero.
-    bool bucket_used[n_heap_buckets]{};
-};
-
-// One way to allocate a Heap is to declare it at namespace scope so it has static storage duration.  Because its lifetime
-// begins when the program starts, you can use it inside the operator new and operator delete overrides.
+// time_allocations returns how long a new and a delete of a small object take on average, in nanoseconds.
+double time_allocations()
+{
+    static void* objects[100'000];
+    const auto start = std::chrono::steady_clock::now();
+    for (auto& object : objects)
+    {
+        object = operator new(200);
+        *static_cast<char*>(object) = 1;
+    }
+    for (auto object : objects) operator delete(object);
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / std::size(objects);
+}
 
-Heap heap;
-void* operator new(size_t n_bytes)
+// purge_demo allocates a burst of 256 MiB in small objects and frees it all again, while a thread in the background
+// purges the heap every quarter of the decay time. Once the burst's Buckets have been idle for the decay time, the
+// resident set drops back down. Allocating is timed before the burst and after the purge. Both times, the Buckets it
+// takes have to be faulted in, never-used ones before and purged ones after, so the two should take about as long.
+// Faulting in happens once per Bucket rather than once per allocation.
+void purge_demo(std::chrono::milliseconds decay)
 {
-    return heap.allocate(n_bytes);
+    heap.set_purge_decay(decay);
+    std::atomic<bool> done{};
+    std::thread purger{ [&]
+    {
+        while (!done.load())
+        {
+            heap.purge();
+            std::this_thread::sleep_for(decay / 4);
+        }
+    } };
+    printf("Before the burst: %7.1f MiB resident, %6.1f ns per new and delete\n", resident_kib() / 1024.0,
+           time_allocations());
+    static void* objects[1 << 20];
+    for (auto& object : objects)
+    {
+        object = operator new(256);
+        *static_cast<char*>(object) = 1;
+    }
+    printf("During the burst: %7.1f MiB resident\n", resident_kib() / 1024.0);
+    for (auto object : objects) operator delete(object);
+    printf("After the burst:  %7.1f MiB resident\n", resident_kib() / 1024.0);
+    std::this_thread::sleep_for(2 * decay);
+    printf("After the decay:  %7.1f MiB resident, %6.1f ns per new and delete\n", resident_kib() / 1024.0, time_allocations());
+    done.store(true);
+    purger.join();
+    heap.dump_stats(stdout);
 }
 
-void operator delete(void* p)
+// real_time_demo runs a hot loop like the one an AutoBrake (see testing.cpp) would run, on the heap in the real-time
+// mode: it keeps the last 256 events it received and replaces the oldest one with a new one, of one of a few sizes, on
+// every step. The loop runs once to warm up its own stack, and is then checked with a FaultCounter. It returns whether
+// the checked run made it through without a page fault or a blocking system call.
+bool real_time_demo(size_t n_buckets)
 {
-    return heap.free(p);
+    const auto locked = heap.set_real_time(n_buckets);
+    const auto prepared = thread_cache.prepare();
+    printf("Real-time mode:   %zu Buckets %s\n", n_buckets, locked && prepared ? "locked in memory"
+                                                          : "touched, but not locked in memory (see ulimit -l)");
+    const size_t sizes[]{ sizeof(double), 3 * sizeof(double), 200, 1000 };
+    void* events[256]{};
+    const auto run = [&](size_t n_steps)
+    {
+        for (size_t i{}; i < n_steps; i++)
+        {
+            auto& event = events[i % std::size(events)];
+            operator delete(event);
+            event = operator new(sizes[i % 7 % std::size(sizes)]);
+            *static_cast<char*>(event) = 1;
+        }
+    };
+    run(std::size(events));
+    const size_t n_steps{ 10'000'000 };
+    FaultCounter faults;
+    const auto start = std::chrono::steady_clock::now();
+    run(n_steps);
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    const auto counts = faults.counts();
+    for (auto& event : events) operator delete(event);
+    printf("%zu steps:   %.1f ns per new and delete, %ld minor faults, %ld major faults, %ld voluntary context "
+           "switches\n", n_steps, elapsed.count() / n_steps, counts.minor_faults, counts.major_faults,
+           counts.voluntary_switches);
+    printf("The hot loop %s.\n", counts.none() ? "never waited for the kernel" : "WAITED for the kernel");
+    return counts.none();
 }
 
-int main()
+// Run with "stress", "scaling" or "contention" as the first argument to run the multi-threaded stress test, the
+// scaling benchmark or the Bucket pool contention benchmark instead of the demonstration. An optional second argument
+// sets the number of threads, and for the stress test a third argument of "lock-free" switches the pool mode. Run with
+// "purge" and an optional decay time in milliseconds to watch the heap give memory back after a burst, and with
+// "realtime" and an optional number of Buckets to check a hot loop on the heap in the real-time mode.
+int main(int argc, char* argv[])
 {
-    // print the memory address of the first buckets element of the heap.
-    // This is the memory location loaned out to the first new invocation.
-    printf("Buckets:    %p\n", heap.buckets);
+    const size_t n_threads{ argc > 2 ? std::strtoull(argv[2], nullptr, 10)
+                                     : std::max(std::thread::hardware_concurrency(), 2u) };
+    if (argc > 1 && std::strcmp(argv[1], "stress") == 0)
+    {
+        heap.set_pool_mode(argc > 3 && std::strcmp(argv[3], "lock-free") == 0 ? Heap::PoolMode::lock_free
+                                                                             : Heap::PoolMode::mutex);
+        const auto passed = stress_test(n_threads, 200'000);
+        printf("Stress test on %zu threads %s.\n", n_threads, passed ? "passed" : "FAILED");
+        heap.dump_stats(stdout);
+        return passed ? 0 : 1;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "scaling") == 0)
+    {
+        scaling_benchmark(n_threads);
+        return 0;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "contention") == 0)
+    {
+        contention_benchmark(n_threads);
+        return 0;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "purge") == 0)
+    {
+        purge_demo(std::chrono::milliseconds{ argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1'000 });
+        return 0;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "realtime") == 0)
+    {
+        try
+        {
+            return real_time_demo(argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1'024) ? 0 : 1;
+        }
+        catch (const std::bad_alloc&)
+        {
+            printf("std::bad_alloc caught: the real-time heap ran out of Buckets.\n");
+            return 1;
+        }
+    }
     auto breakfast = new unsigned int { 0xC0FFEE };
     auto dinner = new unsigned int { 0xDEADBEEF };
+    // print the memory address of the first buckets element of the heap, which the first new invocation reserved.
+    // This is the memory location loaned out to the first new invocation.
+    printf("Buckets:    %p\n", heap.buckets);
     // double check that the memory address is the same as the first bucket in the heap
     printf("Breakfast: %p 0x%x\n", breakfast, *breakfast);
-    // print out the next memory address, which coincides with the 4096 byte length of a Bucket.
+    // print out the next memory address. An unsigned int falls into the 16-byte size class, so dinner shares the first
+    // Bucket with breakfast and sits 16 bytes after it.
     printf("Dinner:    %p 0x%x\n", dinner, *dinner);
-    // delete both buckets
+    printf("Bucket order is %s.\n", check_bucket_order() ? "deterministic" : "NOT deterministic");
+    // delete both slots. Once the last slot in a Bucket is freed, the whole Bucket goes back to the heap.
     delete breakfast;
     delete dinner;
+    // A pointer the heap never handed out is passed on to the fallback deallocator rather than being dropped.
+    heap.fallback_free = [](void* p)
+    {
+        printf("Foreign:   %p handed to the fallback deallocator.\n", p);
+        std::free(p);
+    };
+    heap.free(std::malloc(sizeof(unsigned int)));
+    report_size_class_savings();
+    // A request bigger than a Bucket gets its own page-aligned mapping, just past a LargeHeader.
+    auto banquet = new unsigned int[10'000]{};
+    printf("Banquet:   %p (%zu bytes)\n", banquet, 10'000 * sizeof(unsigned int));
+    delete[] banquet;
+    // Over-aligned types get memory aligned as strictly as they ask for.
+    auto line = new CacheLine{};
+    auto page = new Page{};
+    printf("CacheLine: %p (%zu-byte aligned: %s)\n", line, alignof(CacheLine),
+           reinterpret_cast<uintptr_t>(line) % alignof(CacheLine) == 0 ? "yes" : "no");
+    printf("Page:      %p (%zu-byte aligned: %s)\n", page, alignof(Page),
+           reinterpret_cast<uintptr_t>(page) % alignof(Page) == 0 ? "yes" : "no");
+    delete line;
+    delete page;
+    // Everything allocated in an Arena is released at once, with a single reset, which runs the destructors too.
+    {
+        Arena arena{ heap };
+        for (size_t seat{}; seat < 1'000; seat++) arena.create<Guest>(seat);
+        const auto seated = heap.snapshot().live_buckets;
+        arena.reset();
+        printf("Arena:     1000 Guests, %zu Buckets live while seated, %zu after reset, %zu destructors run\n",
+               static_cast<size_t>(seated), static_cast<size_t>(heap.snapshot().live_buckets), Guest::n_departed);
+    }
     // then allocate char objects with reckless abandon until a std::bad_alloc is thrown in when heap runs out of memory
-    // This is the exact same number of buckets allocated in Heap::n_heap_buckets.
-    // For each char allocated, you've taken up 4096 bytes of memory.
+    // The heap would grow until it had mapped gigabytes, so cap it at ten Buckets first, like the original fixed heap.
+    // Each char takes up a 16-byte slot, so ten Buckets fit 2560 of them before the heap runs out, or fewer, since some
+    // Buckets are still loaned out to other size classes.
+    // Each new char is stored to a volatile pointer, or the compiler could drop the allocations as unused.
+    heap.set_max_buckets(10);
+    size_t n_chars{};
+    char* volatile last_char{};
     try
     {
         while (true)
         {
-            new char;
-            printf("Allocated a char.\n");
+            last_char = new char;
+            n_chars++;
         }
     }
     catch (const std::bad_alloc&)
     {
+        printf("Allocated %zu chars, the last one at %p.\n", n_chars, static_cast<void*>(last_char));
         printf("std::bad_alloc caught.\n");
     }
+    // Dump the heap's statistics, which show the chars, the failed allocation and the waste from rounding up.
+    heap.dump_stats(stdout);
 }
-
-
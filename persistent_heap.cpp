@@ -0,0 +1,136 @@
+// Persistent heap
+// Shows a PersistentHeap from persistent_heap.hpp keeping a data structure across restarts. The first run builds an
+// order book, a linked list of Orders, in a heap kept in a file, and names it "orders" in the heap's root directory.
+// Building it stands in for the slow part of a program's startup, like parsing a big input file. Every later run just
+// opens the file, looks the order book up by its name, and walks it, without rebuilding or parsing anything.
+
+// The Orders link to each other with OffsetPtrs, which stay valid when the file is mapped at a different address. To
+// show that, the first run also reopens the file while its old address is still taken, so the mapping has to move.
+// Delete the file to start over.
+
+// A run that is killed before it closes the heap leaves a file that wasn't closed. The next run opens it with recover,
+// and builds the order book again if the killed run hadn't got as far as naming it.
+
+// Build and run with:
+//  g++ -std=c++17 -O2 -pthread persistent_heap.cpp -o persistent_heap
+//  ./persistent_heap orders.heap [orders]
+//  ./persistent_heap orders.heap
+
+#include "persistent_heap.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+
+struct Order
+{
+    uint64_t id;
+    double price;
+    uint32_t quantity;
+    OffsetPtr<Order> next;
+};
+
+// An OrderBook is the root of the order book. It is the only object the program finds by name.
+struct OrderBook
+{
+    uint64_t n_orders;
+    OffsetPtr<Order> first;
+    OffsetPtr<Order> last;
+};
+
+void build(PersistentHeap& heap, size_t n_orders)
+{
+    const auto book = new(heap.allocate(sizeof(OrderBook))) OrderBook{};
+    for (size_t i{}; i < n_orders; i++)
+    {
+        const auto order = new(heap.allocate(sizeof(Order))) Order{ i, 100.0 + i % 1000 / 100.0,
+                                                                  static_cast<uint32_t>(1 + i % 50), nullptr };
+        if (book->last) book->last->next = order;
+        else book->first = order;
+        book->last = order;
+        book->n_orders++;
+    }
+    heap.set_root("orders", book);
+}
+
+// walk follows the order book from its root, and returns the total value of the orders in it.
+double walk(PersistentHeap& heap, uint64_t& n_orders)
+{
+    const auto book = heap.root<OrderBook>("orders");
+    n_orders = 0;
+    if (!book) return 0;
+    double total{};
+    for (auto order = book->first.get(); order; order = order->next.get())
+    {
+        total += order->price * order->quantity;
+        n_orders++;
+    }
+    return n_orders == book->n_orders ? total : -1;
+}
+
+template <typename Function>
+double milliseconds(Function function)
+{
+    const auto start = std::chrono::steady_clock::now();
+    function();
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+const char* describe(PersistentHeap::OpenResult result)
+{
+    switch (result)
+    {
+        case PersistentHeap::OpenResult::locked: return "is in use by another process";
+        case PersistentHeap::OpenResult::not_closed: return "wasn't closed the last time it was used";
+        case PersistentHeap::OpenResult::not_a_heap: return "isn't a persistent heap";
+        default: return "couldn't be opened";
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s heap-file [orders]\n", argv[0]);
+        return 1;
+    }
+    const size_t n_orders{ argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1'000'000 };
+    PersistentHeap heap;
+    const auto result = heap.open(argv[1], n_orders / (Bucket::data_size / 64) + 16, true);
+    if (result != PersistentHeap::OpenResult::created && result != PersistentHeap::OpenResult::opened
+        && result != PersistentHeap::OpenResult::recovered)
+    {
+        printf("%s %s.\n", argv[1], describe(result));
+        return 1;
+    }
+    if (result == PersistentHeap::OpenResult::recovered) printf("Recovered %s, which wasn't closed.\n", argv[1]);
+    uint64_t n_walked{};
+    double total{};
+    if (!heap.root<OrderBook>("orders"))
+    {
+        printf("Built %zu orders in %.1f ms, at %p.\n", n_orders,
+               milliseconds([&] { build(heap, n_orders); }), static_cast<void*>(heap.address()));
+        // Reopen the heap with its old address taken, to make it move.
+        const auto old_address = heap.address();
+        heap.close();
+        const auto placeholder = mmap(old_address, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        const auto reopened = heap.open(argv[1], 0);
+        if (placeholder != MAP_FAILED) munmap(placeholder, 4096);
+        if (reopened != PersistentHeap::OpenResult::opened)
+        {
+            printf("%s %s.\n", argv[1], describe(reopened));
+            return 1;
+        }
+        printf("Reopened at %p.\n", static_cast<void*>(heap.address()));
+    }
+    const auto elapsed = milliseconds([&] { total = walk(heap, n_walked); });
+    if (total < 0)
+    {
+        printf("The order book is corrupted.\n");
+        return 1;
+    }
+    printf("Found %llu orders worth %.2f in %.1f ms, with %zu Buckets in use.\n",
+           static_cast<unsigned long long>(n_walked), total, elapsed, heap.in_use());
+}
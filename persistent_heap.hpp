@@ -0,0 +1,482 @@
+// persistent_heap.hpp holds PersistentHeap, a heap whose Buckets live in a memory-mapped file rather than in anonymous
+// memory, so whatever a program builds in it is still there the next time the program opens the file. OffsetPtr is
+// the pointer to use inside such a heap, and persistent_heap.cpp shows both of them at work.
+
+#ifndef CRASH_COURSE_PERSISTENT_HEAP_HPP
+#define CRASH_COURSE_PERSISTENT_HEAP_HPP
+
+#include "heap.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A file is mapped wherever the system finds room for it, which is rarely the same address twice, so an ordinary
+// pointer stored in the file is wrong the next time it's opened. An OffsetPtr stores how far its target is from the
+// OffsetPtr itself instead. As long as both sit in the same mapping, that distance doesn't change when the mapping
+// moves. Zero means null, so an OffsetPtr can't point at itself.
+// Copying an OffsetPtr works out the distance anew from the copy's own address, which is why it has a copy constructor
+// and isn't trivially copyable: a structure holding OffsetPtrs must not be copied with memcpy.
+template <typename T>
+struct OffsetPtr
+{
+    OffsetPtr() = default;
+    OffsetPtr(T* p)
+    {
+        set(p);
+    }
+    OffsetPtr(const OffsetPtr& other)
+    {
+        set(other.get());
+    }
+    OffsetPtr& operator=(const OffsetPtr& other)
+    {
+        set(other.get());
+        return *this;
+    }
+    OffsetPtr& operator=(T* p)
+    {
+        set(p);
+        return *this;
+    }
+
+    T* get() const
+    {
+        return offset ? reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(this) + offset) : nullptr;
+    }
+    T& operator*() const
+    {
+        return *get();
+    }
+    T* operator->() const
+    {
+        return get();
+    }
+    explicit operator bool() const
+    {
+        return offset != 0;
+    }
+
+private:
+    void set(T* p)
+    {
+        offset = p ? reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(this) : 0;
+    }
+
+    uintptr_t offset{};
+};
+
+// PersistentHeap keeps everything it knows in the file, next to the Buckets: a Header on the first page, then a table
+// of FileBucketInfo, then the Buckets themselves. It hands out slots in the same size classes as Heap, up to a whole
+// Bucket, and keeps its free lists and its chains of Buckets with free slots as offsets and indices rather than
+// pointers. Reopening the file therefore needs no rebuilding at all: the heap, and everything in it, is ready the moment
+// the file is mapped.
+// To find its data again, a program gives the objects it starts from names in the root directory with set_root, and
+// looks them up with root after reopening. Everything else is reached from them through OffsetPtrs. Objects stored in a
+// PersistentHeap must not hold ordinary pointers, or anything else that only means something in one run of a program,
+// like a virtual function table or a std::string that allocates.
+// The file is made big enough for capacity Buckets when it's created, but the file system only stores the pages that
+// are written to. A PersistentHeap is safe to use from many threads, but the file is locked while it's open, so only
+// one process can use it at a time.
+// The file is shared with the system's page cache, so when a process dies without closing the heap, everything it
+// wrote is still in the file. Unless the process died in the middle of an allocate or free, the heap's bookkeeping is
+// consistent too. Every allocate and free notes in the Header that it is busy, and with which Bucket, while it
+// changes anything, so a later open can tell. Such a file is refused by default, but can be opened with recover (see
+// open). None of this helps if the whole system goes down before the pages reach the disk: only sync waits for that.
+struct PersistentHeap
+{
+    PersistentHeap() = default;
+    PersistentHeap(const PersistentHeap&) = delete;
+    PersistentHeap& operator=(const PersistentHeap&) = delete;
+    ~PersistentHeap()
+    {
+        close();
+    }
+
+    enum class OpenResult
+    {
+        created,
+        opened,
+        recovered,
+        failed,
+        locked,
+        not_closed,
+        not_a_heap
+    };
+
+    // open maps the heap in the file at path. If there's no such file, it creates one with room for capacity Buckets.
+    // A file that wasn't closed is refused unless recover is true. Then open repairs the heap's bookkeeping if the
+    // process died in the middle of an allocate or free, and returns recovered. Whether the objects in the heap are
+    // consistent is up to the program: the heap can't know what the program was in the middle of.
+    OpenResult open(const char* path, size_t capacity, bool recover = false)
+    {
+        std::lock_guard<std::mutex> lock{ heap_lock };
+        if (base) return OpenResult::failed;
+        fd = ::open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return OpenResult::failed;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) return fail(OpenResult::locked);
+        struct stat status{};
+        if (fstat(fd, &status) != 0) return fail(OpenResult::failed);
+        const auto created = status.st_size == 0;
+        if (created && (capacity == 0 || capacity >= UINT32_MAX)) return fail(OpenResult::failed);
+        if (created && ftruncate(fd, static_cast<off_t>(file_bytes(capacity))) != 0) return fail(OpenResult::failed);
+        if (!created)
+        {
+            Header header{};
+            if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+                || std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0
+                || status.st_size != static_cast<off_t>(file_bytes(header.capacity)))
+            {
+                return fail(OpenResult::not_a_heap);
+            }
+            if (!header.closed && !recover) return fail(OpenResult::not_closed);
+            capacity = header.capacity;
+        }
+        mapped_bytes = file_bytes(capacity);
+        const auto mapped = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) return fail(OpenResult::failed);
+        base = static_cast<std::byte*>(mapped);
+        info = reinterpret_cast<FileBucketInfo*>(base + page_size);
+        buckets = reinterpret_cast<Bucket*>(base + buckets_offset(capacity));
+        if (created)
+        {
+            header().capacity = capacity;
+            std::memcpy(header().magic, file_magic, sizeof(file_magic));
+            header().closed = true;
+        }
+        const auto recovered = !header().closed;
+        if (recovered && header().busy) repair();
+        header().closed = false;
+        if (created) return OpenResult::created;
+        return recovered ? OpenResult::recovered : OpenResult::opened;
+    }
+
+    // close writes everything back to the file, marks it as closed and unmaps it. Every pointer into the heap, and every
+    // OffsetPtr inside it, is invalid afterwards.
+    void close()
+    {
+        std::lock_guard<std::mutex> lock{ heap_lock };
+        if (!base) return;
+        header().closed = true;
+        msync(base, mapped_bytes, MS_SYNC);
+        munmap(base, mapped_bytes);
+        ::close(fd);
+        base = nullptr;
+        fd = -1;
+    }
+
+    // sync waits until everything written to the heap so far is in the file.
+    bool sync()
+    {
+        std::lock_guard<std::mutex> lock{ heap_lock };
+        return base && msync(base, mapped_bytes, MS_SYNC) == 0;
+    }
+
+    // allocate hands out a slot of the smallest size class that holds bytes, aligned to its own size like Heap's are.
+    // Requests bigger than a Bucket throw std::bad_alloc, as does a heap that is full.
+    void* allocate(size_t bytes, size_t alignment = Heap::default_alignment)
+    {
+        const auto rounded = bytes < alignment ? alignment : bytes;
+        if (rounded > Bucket::data_size) throw std::bad_alloc{};
+        const auto c = Heap::size_class(rounded);
+        std::lock_guard<std::mutex> lock{ heap_lock };
+        if (!base) throw std::bad_alloc{};
+        Busy busy{ header() };
+        auto& partial = header().partial[c];
+        if (!partial)
+        {
+            const auto i = take_bucket(c);
+            if (!i) throw std::bad_alloc{};
+            if (c == Heap::whole_bucket_class)
+            {
+                info[i - 1].live = 1;
+                return buckets[i - 1].data;
+            }
+            push_partial(i);
+        }
+        const auto i = partial;
+        busy.set(i);
+        auto& bucket = info[i - 1];
+        std::byte* slot{};
+        if (bucket.free_slots)
+        {
+            slot = base + bucket.free_slots;
+            bucket.free_slots = *reinterpret_cast<uint64_t*>(slot);
+        }
+        else
+        {
+            slot = buckets[i - 1].data + bucket.n_fresh++ * Heap::slot_size(c);
+        }
+        if (++bucket.live == Heap::slots_per_bucket(c)) remove_partial(i);
+        return slot;
+    }
+
+    // free gives p back to its Bucket, and the Bucket back to the heap once none of its slots are in use. p must have
+    // come from allocate on this heap. A p outside the Buckets allocate has handed out, or any p once the heap is
+    // closed, is ignored rather than written into the file.
+    void free(void* p)
+    {
+        if (!p) return;
+        std::lock_guard<std::mutex> lock{ heap_lock };
+        if (!base) return;
+        const auto offset = reinterpret_cast<uintptr_t>(p)
+                            - reinterpret_cast<uintptr_t>(base + buckets_offset(header().capacity));
+        if (offset >= header().n_fresh * sizeof(Bucket)) return;
+        const auto i = static_cast<uint32_t>(offset / sizeof(Bucket) + 1);
+        Busy busy{ header() };
+        busy.set(i);
+        auto& bucket = info[i - 1];
+        if (bucket.size_class == Heap::whole_bucket_class)
+        {
+            release_bucket(i);
+            return;
+        }
+        *static_cast<uint64_t*>(p) = bucket.free_slots;
+        bucket.free_slots = static_cast<std::byte*>(p) - base;
+        if (bucket.live-- == Heap::slots_per_bucket(bucket.size_class)) push_partial(i);
+        if (bucket.live == 0)
+        {
+            remove_partial(i);
+            release_bucket(i);
+        }
+    }
+
+    // set_root names p in the root directory, or removes the name if p is null. It returns false if the name is too
+    // long, or the directory is full.
+    bool set_root(const char* name, const void* p)
+    {
+        if (std::strlen(name) >= sizeof(Root::name)) return false;
+        std::lock_guard<std::mutex> lock{ heap_lock };
+        if (!base) return false;
+        Root* unused{};
+        for (auto& root : header().roots)
+        {
+            if (std::strcmp(root.name, name) == 0)
+            {
+                if (!p) root = Root{};
+                else root.offset = static_cast<const std::byte*>(p) - base;
+                return true;
+            }
+            if (!unused && root.name[0] == '\0') unused = &root;
+        }
+        if (!p) return true;
+        if (!unused) return false;
+        std::strcpy(unused->name, name);
+        unused->offset = static_cast<const std::byte*>(p) - base;
+        return true;
+    }
+
+    // root finds the object named name in the root directory, or returns null if there is none.
+    template <typename T>
+    T* root(const char* name)
+    {
+        std::lock_guard<std::mutex> lock{ heap_lock };
+        if (!base) return nullptr;
+        for (const auto& root : header().roots)
+        {
+            if (root.name[0] != '\0' && std::strcmp(root.name, name) == 0) return reinterpret_cast<T*>(base + root.offset);
+        }
+        return nullptr;
+    }
+
+    // in_use counts the Buckets loaned out right now.
+    size_t in_use()
+    {
+        std::lock_guard<std::mutex> lock{ heap_lock };
+        return base ? header().live_buckets : 0;
+    }
+
+    std::byte* address() const
+    {
+        return base;
+    }
+
+private:
+    static const size_t page_size{ 4096 };
+    static const size_t max_roots{ 32 };
+
+    struct Root
+    {
+        char name[56];
+        uint64_t offset;
+    };
+
+    // The Header sits on the first page of the file. Bucket indices are stored plus one, so zero ends a chain, like in
+    // Heap.
+    // busy is nonzero while an allocate or free is changing the bookkeeping: the index plus one of the Bucket whose slots
+    // it is changing, or any_bucket before it knows which.
+    struct Header
+    {
+        char magic[8];
+        uint64_t capacity;
+        uint64_t closed;
+        uint64_t busy;
+        uint64_t n_fresh;
+        uint64_t live_buckets;
+        uint64_t free_buckets;
+        uint64_t partial[Heap::n_size_classes];
+        Root roots[max_roots];
+    };
+    static_assert(sizeof(Header) <= page_size, "The Header fits on the first page.");
+
+    // FileBucketInfo is BucketInfo with offsets from the start of the file in place of pointers. A free Bucket is
+    // chained into free_buckets through next.
+    struct FileBucketInfo
+    {
+        uint32_t size_class;
+        uint32_t live;
+        uint32_t n_fresh;
+        uint32_t prev;
+        uint32_t next;
+        uint64_t free_slots;
+    };
+
+    static constexpr char file_magic[8]{ 'H', 'E', 'A', 'P', 'F', 'I', 'L', '2' };
+    static const uint64_t any_bucket{ UINT64_MAX };
+
+    // Busy marks the Header busy for as long as it exists. The signal fences keep the compiler from moving the heap's
+    // other stores to the file before the mark is set or after it is cleared, which is all a process that dies needs:
+    // whatever it stored is in the page cache.
+    struct Busy
+    {
+        explicit Busy(Header& header) : header{ header }
+        {
+            set(any_bucket);
+        }
+        ~Busy()
+        {
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            header.busy = 0;
+        }
+        void set(uint64_t busy)
+        {
+            header.busy = busy;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        }
+
+        Header& header;
+    };
+
+    Header& header() const
+    {
+        return *reinterpret_cast<Header*>(base);
+    }
+
+    static size_t buckets_offset(size_t capacity)
+    {
+        return page_size + (capacity * sizeof(FileBucketInfo) + page_size - 1) / page_size * page_size;
+    }
+
+    static size_t file_bytes(size_t capacity)
+    {
+        return buckets_offset(capacity) + capacity * sizeof(Bucket);
+    }
+
+    // repair rebuilds the bookkeeping of a heap whose process died in the middle of an allocate or free. A Bucket is in
+    // use exactly when its live count isn't zero; a whole Bucket counts as one live slot. The one Bucket whose slots were
+    // being changed, if the Header says which, can't be trusted, so it is sealed: marked full, with no free slots left.
+    // The slots in it that were free are lost, but none of the live ones can be handed out twice. Everything else, the
+    // stack of free Buckets, the chains of Buckets with free slots and the count of Buckets in use, follows from the
+    // Buckets themselves and is built afresh.
+    void repair()
+    {
+        auto& h = header();
+        if (h.busy != any_bucket && h.busy <= h.n_fresh)
+        {
+            auto& bucket = info[h.busy - 1];
+            const size_t c = bucket.size_class < Heap::whole_bucket_class ? bucket.size_class : Heap::whole_bucket_class;
+            bucket.size_class = static_cast<uint32_t>(c);
+            bucket.live = bucket.n_fresh = static_cast<uint32_t>(Heap::slots_per_bucket(c));
+            bucket.free_slots = 0;
+        }
+        h.free_buckets = 0;
+        h.live_buckets = 0;
+        std::fill(std::begin(h.partial), std::end(h.partial), 0);
+        for (auto i = static_cast<uint32_t>(h.n_fresh); i > 0; i--)
+        {
+            auto& bucket = info[i - 1];
+            if (!bucket.live)
+            {
+                bucket.next = static_cast<uint32_t>(h.free_buckets);
+                h.free_buckets = i;
+                continue;
+            }
+            h.live_buckets++;
+            if (bucket.live < Heap::slots_per_bucket(bucket.size_class)) push_partial(i);
+        }
+        h.busy = 0;
+    }
+
+    OpenResult fail(OpenResult result)
+    {
+        ::close(fd);
+        fd = -1;
+        return result;
+    }
+
+    // take_bucket takes a free Bucket for size class c, or a never-used one if there are none, and returns its index
+    // plus one, or zero if the heap is full. The caller holds heap_lock.
+    uint32_t take_bucket(size_t c)
+    {
+        auto& h = header();
+        uint32_t i{};
+        if (h.free_buckets)
+        {
+            i = static_cast<uint32_t>(h.free_buckets);
+            h.free_buckets = info[i - 1].next;
+        }
+        else if (h.n_fresh < h.capacity)
+        {
+            i = static_cast<uint32_t>(++h.n_fresh);
+        }
+        else return 0;
+        info[i - 1] = FileBucketInfo{ static_cast<uint32_t>(c), 0, 0, 0, 0, 0 };
+        h.live_buckets++;
+        return i;
+    }
+
+    void release_bucket(uint32_t i)
+    {
+        auto& h = header();
+        info[i - 1].live = 0;
+        info[i - 1].next = static_cast<uint32_t>(h.free_buckets);
+        h.free_buckets = i;
+        h.live_buckets--;
+    }
+
+    void push_partial(uint32_t i)
+    {
+        auto& bucket = info[i - 1];
+        auto& head = header().partial[bucket.size_class];
+        bucket.prev = 0;
+        bucket.next = static_cast<uint32_t>(head);
+        if (head) info[head - 1].prev = i;
+        head = i;
+    }
+
+    void remove_partial(uint32_t i)
+    {
+        auto& bucket = info[i - 1];
+        if (bucket.prev) info[bucket.prev - 1].next = bucket.next;
+        else header().partial[bucket.size_class] = bucket.next;
+        if (bucket.next) info[bucket.next - 1].prev = bucket.prev;
+        bucket.prev = bucket.next = 0;
+    }
+
+    std::mutex heap_lock;
+    int fd{ -1 };
+    std::byte* base{};
+    size_t mapped_bytes{};
+    FileBucketInfo* info{};
+    Bucket* buckets{};
+};
+
+#endif //CRASH_COURSE_PERSISTENT_HEAP_HPP
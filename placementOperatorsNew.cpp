@@ -17,7 +17,11 @@
 
 #include <cstdio>
 #include <cstddef>
+#include <cstdint>
 #include <new>
+#include <chrono>
+#include <type_traits>
+#include <utility>
 
 struct Point
 {
@@ -34,10 +38,216 @@ struct Point
     double x, y, z;
 };
 
+// Vector3 has no constructor or destructor of its own, so it is trivially destructible: its destructor does nothing.
+struct Vector3
+{
+    double x, y, z;
+};
+
+// ObjectPool turns the pattern in main into something reusable. Rather than one buffer for three Points, it allocates
+// slabs, each with room for slots_per_slab objects of type T, and constructs objects into their slots with placement
+// new. A slot that isn't in use holds a pointer to the next free slot, so create pops a slot off that free list and
+// destroy pushes it back on: both are constant time, and neither touches the free store except when create needs a
+// new slab. For trivially destructible types like Vector3, destroy skips the destructor call altogether.
+// Every slab is a power of two bytes and aligned to its own size, so destroy finds the slab a pointer belongs to by
+// clearing the low bits of its address. Each slab also keeps a bit per slot that says whether it holds an object,
+// so when the pool is destroyed, it can destroy whatever objects are still alive.
+template <typename T>
+struct ObjectPool
+{
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+    ~ObjectPool()
+    {
+        while (slabs)
+        {
+            const auto slab = slabs;
+            slabs = slab->next;
+            if constexpr (!std::is_trivially_destructible_v<T>)
+            {
+                for (auto live = slab->live; live; live &= live - 1)
+                {
+                    slab->slots[__builtin_ctzll(live)].object()->~T();
+                }
+            }
+            slab->~Slab();
+            operator delete(slab, std::align_val_t{ slab_size });
+        }
+    }
+
+    // create constructs a T from args in a free slot. If the constructor throws, the slot goes back to the free list.
+    template <typename... Args>
+    T* create(Args&&... args)
+    {
+        if (!free_slots) add_slab();
+        const auto slot = pop();
+        try
+        {
+            return construct(slot, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            push(slot);
+            throw;
+        }
+    }
+
+    // create_n constructs n objects from the same args and stores pointers to them in objects. It adds every slab it
+    // needs before constructing anything, so the objects come out of as few slabs as possible. Each object is made by
+    // create, so if a constructor throws, its slot goes back to the free list, and the objects constructed so far are
+    // destroyed again: none are created.
+    template <typename... Args>
+    void create_n(size_t n, T** objects, const Args&... args)
+    {
+        while (n_free < n) add_slab();
+        size_t created{};
+        try
+        {
+            for (; created < n; created++) objects[created] = create(args...);
+        }
+        catch (...)
+        {
+            while (created) destroy(objects[--created]);
+            throw;
+        }
+    }
+
+    // destroy ends the lifetime of an object made by create, and gives its slot back to the pool.
+    void destroy(T* object)
+    {
+        if (!object) return;
+        if constexpr (!std::is_trivially_destructible_v<T>) object->~T();
+        push(reinterpret_cast<Slot*>(object));
+    }
+
+private:
+    // A Slot holds either an object or, while it's free, the link to the next free slot.
+    union Slot
+    {
+        Slot* next;
+        alignas(T) std::byte storage[sizeof(T)];
+
+        T* object()
+        {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+    };
+
+    static constexpr size_t round_down_to_power_of_two(size_t n)
+    {
+        size_t power{ 1 };
+        while (power * 2 <= n) power *= 2;
+        return power;
+    }
+
+    // The slab size comes first: the largest power of two that 64 slots and a slab's next link and live bits would
+    // fill. The slab then gets as many slots as fit next to those, at most 64 for the live bits, so it wastes less
+    // than one slot. Rounding up instead would waste up to half of every slab.
+    static constexpr size_t slab_header_size{ sizeof(void*) + sizeof(uint64_t) };
+    static constexpr size_t slab_size{ round_down_to_power_of_two(64 * sizeof(Slot) + slab_header_size) };
+    static constexpr size_t slots_per_slab{ (slab_size - slab_header_size) / sizeof(Slot) < 64
+                                                ? (slab_size - slab_header_size) / sizeof(Slot)
+                                                : 64 };
+
+    struct Slab
+    {
+        Slot slots[slots_per_slab];
+        Slab* next;
+        uint64_t live;
+    };
+    static_assert(sizeof(Slab) <= slab_size, "A slab fits in slab_size bytes.");
+
+    static Slab* slab_of(Slot* slot)
+    {
+        return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(slot) & ~(slab_size - 1));
+    }
+
+    static uint64_t bit(Slab* slab, Slot* slot)
+    {
+        return uint64_t{ 1 } << (slot - slab->slots);
+    }
+
+    // add_slab allocates a slab, aligned to slab_size, and pushes all of its slots onto the free list, last slot
+    // first, so they are handed out in address order.
+    void add_slab()
+    {
+        const auto slab = new(operator new(slab_size, std::align_val_t{ slab_size })) Slab{};
+        slab->next = slabs;
+        slabs = slab;
+        for (auto i = slots_per_slab; i > 0; i--) push(&slab->slots[i - 1]);
+    }
+
+    // construct uses parentheses, like std::make_unique, so a T with an initializer_list constructor gets the
+    // constructor that matches args rather than a list of them, and args may need a narrowing conversion. Only a T that
+    // has no constructor taking args, an aggregate like Vector3 before C++20, is initialized with braces.
+    template <typename... Args>
+    T* construct(Slot* slot, Args&&... args)
+    {
+        T* object;
+        if constexpr (std::is_constructible_v<T, Args&&...>) object = new(slot->storage) T(std::forward<Args>(args)...);
+        else object = new(slot->storage) T{ std::forward<Args>(args)... };
+        const auto slab = slab_of(slot);
+        slab->live |= bit(slab, slot);
+        return object;
+    }
+
+    Slot* pop()
+    {
+        const auto slot = free_slots;
+        free_slots = slot->next;
+        n_free--;
+        return slot;
+    }
+
+    void push(Slot* slot)
+    {
+        const auto slab = slab_of(slot);
+        slab->live &= ~bit(slab, slot);
+        slot->next = free_slots;
+        free_slots = slot;
+        n_free++;
+    }
+
+    Slab* slabs{};
+    Slot* free_slots{};
+    size_t n_free{};
+};
+
+// time_vectors times making and destroying n Vector3s, n_rounds times over, once with new and delete and once with an
+// ObjectPool.
+void time_vectors(size_t n, size_t n_rounds)
+{
+    static Vector3* vectors[100'000];
+    double sum{};
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round{}; round < n_rounds; round++)
+    {
+        for (size_t i{}; i < n; i++) vectors[i] = new Vector3{ 1.0, 2.0, 3.0 };
+        for (size_t i{}; i < n; i++) sum += vectors[i]->y;
+        for (size_t i{}; i < n; i++) delete vectors[i];
+    }
+    const std::chrono::duration<double, std::nano> with_new = std::chrono::steady_clock::now() - start;
+    ObjectPool<Vector3> pool;
+    start = std::chrono::steady_clock::now();
+    for (size_t round{}; round < n_rounds; round++)
+    {
+        pool.create_n(n, vectors, 1.0, 2.0, 3.0);
+        for (size_t i{}; i < n; i++) sum += vectors[i]->y;
+        for (size_t i{}; i < n; i++) pool.destroy(vectors[i]);
+    }
+    const std::chrono::duration<double, std::nano> with_pool = std::chrono::steady_clock::now() - start;
+    printf("%zu Vector3s, %zu times (checksum %.0f):\n", n, n_rounds, sum);
+    printf("  new and delete: %5.1f ns per object\n", with_new.count() / (n * n_rounds));
+    printf("  ObjectPool:     %5.1f ns per object\n", with_pool.count() / (n * n_rounds));
+}
+
 int main()
 {
     const auto point_size = sizeof(Point);
-    std::byte data[3 * point_size];
+    // data is aligned for Point. A plain std::byte array only has to be aligned to a single byte, and a Point
+    // constructed at a misaligned address is undefined behavior.
+    alignas(Point) std::byte data[3 * point_size];
     // print the address of data, which is the first address where placement new initializes a Point.
     printf("Data starts at %p.\n", data);
     // Each placement of new has allocated the Point within the memory occupied by the data array.
@@ -48,5 +258,20 @@ int main()
     point1->~Point();
     point2->~Point();
     point3->~Point();
+
+    // An ObjectPool does the same bookkeeping for you. The Point it still holds when it goes out of scope is destroyed
+    // along with the pool.
+    {
+        ObjectPool<Point> pool;
+        auto point4 = pool.create();
+        auto point5 = pool.create();
+        pool.destroy(point4);
+        // point6 reuses the slot point4 was in.
+        auto point6 = pool.create();
+        printf("point6 %s point4's slot.\n", point6 == point4 ? "reuses" : "doesn't reuse");
+        pool.destroy(point6);
+        printf("point5 at %p is left for the pool to destroy.\n", static_cast<void*>(point5));
+    }
+    time_vectors(100'000, 100);
 }
 
@@ -0,0 +1,206 @@
+// Allocation trace replay
+// Replays an allocation trace, recorded by running overloadedNewOperator.cpp (or any program with its overrides) with
+// HEAP_TRACE set to a file name, against the Heap from heap.hpp and against the system allocator (malloc and free). That
+// way, allocator designs can be compared on a real program's allocation pattern rather than on a made-up workload.
+
+// Before timing anything, the replay turns the trace into a list of operations on numbered slots: every allocation
+// gets a slot that no live allocation uses, and a free refers to the slot of the allocation it frees. Frees of pointers
+// the trace never saw allocated, like the foreign pointer handed to the fallback deallocator, are dropped. The replay
+// itself then only indexes an array, and every allocator runs exactly the same operations.
+// All the operations are replayed on one thread, in the order of their timestamps, so a trace of a multi-threaded
+// program shows the cost of its allocation pattern, but not of its contention. Each allocator gets a child process of
+// its own, through run_in_child from measurement.hpp, and writes a byte to every page of every allocation it hands
+// out, so the resident set reflects the memory the allocations actually take.
+
+// Build and run with:
+//  g++ -std=c++17 -O2 -pthread overloadedNewOperator.cpp -o overloadedNewOperator
+//  HEAP_TRACE=trace.bin ./overloadedNewOperator stress
+//  g++ -std=c++17 -O2 -pthread trace_replay.cpp -o trace_replay
+//  ./trace_replay trace.bin
+
+#include "heap.hpp"
+#include "allocation_trace.hpp"
+#include "measurement.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
+#include <vector>
+
+Heap heap;
+thread_local ThreadCache thread_cache{ heap };
+
+struct HeapAllocator
+{
+    static constexpr const char* name{ "Heap" };
+    static void* allocate(size_t bytes, size_t alignment)
+    {
+        return thread_cache.allocate(bytes, alignment ? alignment : Heap::default_alignment);
+    }
+    // A free with a size was a sized delete in the traced program, so it is replayed as one.
+    static void free(void* p, size_t bytes, size_t alignment)
+    {
+        if (bytes) thread_cache.free(p, bytes, alignment ? alignment : Heap::default_alignment);
+        else if (alignment) thread_cache.free_aligned(p);
+        else thread_cache.free(p);
+    }
+};
+
+struct SystemAllocator
+{
+    static constexpr const char* name{ "malloc" };
+    static void* allocate(size_t bytes, size_t alignment)
+    {
+        if (alignment <= alignof(std::max_align_t)) return std::malloc(bytes);
+        return std::aligned_alloc(alignment, (bytes + alignment - 1) / alignment * alignment);
+    }
+    static void free(void* p, size_t, size_t)
+    {
+        std::free(p);
+    }
+};
+
+struct Operation
+{
+    uint32_t slot;
+    uint32_t size;
+    uint8_t alignment_log2;
+    bool free;
+};
+
+struct Replay
+{
+    std::vector<Operation> operations;
+    size_t n_slots;
+    size_t n_threads;
+    uint64_t peak_live_bytes;
+};
+
+// read_trace reads a trace file and turns it into a Replay.
+bool read_trace(const char* path, Replay& replay)
+{
+    const auto file = std::fopen(path, "rb");
+    if (!file) return false;
+    char magic[sizeof(trace_magic)]{};
+    std::vector<TraceEvent> events;
+    if (std::fread(magic, 1, sizeof(magic), file) == sizeof(magic) && std::equal(magic, magic + sizeof(magic), trace_magic))
+    {
+        TraceEvent buffer[4096];
+        while (const auto n = std::fread(buffer, sizeof(TraceEvent), std::size(buffer), file))
+        {
+            events.insert(events.end(), buffer, buffer + n);
+        }
+    }
+    std::fclose(file);
+    if (events.empty()) return false;
+    // Each thread's events are already in order, and a stable sort keeps them that way when their times are equal.
+    std::stable_sort(events.begin(), events.end(),
+                     [](const TraceEvent& a, const TraceEvent& b) { return a.time_ns < b.time_ns; });
+
+    std::unordered_map<uint64_t, uint32_t> live;
+    std::vector<uint32_t> free_slots;
+    uint16_t max_thread{};
+    uint64_t live_bytes{};
+    std::vector<uint32_t> slot_sizes;
+    replay = Replay{};
+    for (const auto& event : events)
+    {
+        max_thread = std::max(max_thread, event.thread);
+        if (event.kind == TraceEvent::allocation)
+        {
+            if (event.size == UINT32_MAX) continue;
+            uint32_t slot{};
+            if (free_slots.empty())
+            {
+                slot = static_cast<uint32_t>(slot_sizes.size());
+                slot_sizes.push_back(0);
+            }
+            else
+            {
+                slot = free_slots.back();
+                free_slots.pop_back();
+            }
+            live[event.pointer] = slot;
+            slot_sizes[slot] = event.size;
+            live_bytes += event.size;
+            replay.peak_live_bytes = std::max(replay.peak_live_bytes, live_bytes);
+            replay.operations.push_back(Operation{ slot, event.size, event.alignment_log2, false });
+        }
+        else
+        {
+            const auto found = live.find(event.pointer);
+            if (found == live.end()) continue;
+            const auto slot = found->second;
+            live.erase(found);
+            free_slots.push_back(slot);
+            live_bytes -= slot_sizes[slot];
+            replay.operations.push_back(Operation{ slot, event.size, event.alignment_log2, true });
+        }
+    }
+    replay.n_slots = slot_sizes.size();
+    replay.n_threads = max_thread;
+    return true;
+}
+
+struct Result
+{
+    double seconds;
+    double peak_rss_mib;
+};
+
+template <typename Allocator>
+Result measure(const Replay& replay)
+{
+    std::vector<void*> slots(replay.n_slots);
+    const auto rss_before = resident_kib();
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto& operation : replay.operations)
+    {
+        const size_t alignment{ operation.alignment_log2 ? size_t{ 1 } << operation.alignment_log2 : 0 };
+        auto& slot = slots[operation.slot];
+        if (operation.free)
+        {
+            Allocator::free(slot, operation.size, alignment);
+            continue;
+        }
+        slot = Allocator::allocate(operation.size, alignment);
+        for (size_t offset{}; offset < operation.size; offset += 4096) static_cast<char*>(slot)[offset] = 1;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return Result{ elapsed.count(), peak_growth_mib(rss_before) };
+}
+
+template <typename Allocator>
+void report(const Replay& replay)
+{
+    Result result{};
+    if (!run_in_child([&] { return measure<Allocator>(replay); }, result))
+    {
+        printf("%-8s  failed\n", Allocator::name);
+        return;
+    }
+    printf("%-8s %10.3f %8.1f %12.1f\n", Allocator::name, result.seconds,
+           replay.operations.size() / result.seconds / 1e6, result.peak_rss_mib);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s trace-file\n", argv[0]);
+        return 1;
+    }
+    Replay replay{};
+    if (!read_trace(argv[1], replay))
+    {
+        printf("%s isn't a trace with any events in it.\n", argv[1]);
+        return 1;
+    }
+    printf("%zu operations from %zu threads, at most %zu allocations and %.1f MiB requested live at once\n",
+           replay.operations.size(), replay.n_threads, replay.n_slots, replay.peak_live_bytes / 1048576.0);
+    printf("%-8s %10s %8s %12s\n", "allocator", "seconds", "Mops/s", "peak RSS MiB");
+    report<HeapAllocator>(replay);
+    report<SystemAllocator>(replay);
+}